@@ -0,0 +1,26 @@
+#!/bin/sh
+# Times 100k `test` calls run as a builtin against the same calls through `command test`,
+# which forks and execs /usr/bin/test each time. Both run in a while loop of the shell, so the
+# loop path is measured with them.
+# usage: bench/builtins.sh [path to shellington] [external calls, default 100000]
+SHELLINGTON=${1:-./shellington}
+EXTERNAL=${2:-100000}
+
+# count iterations of body inside one shellington
+calls() {
+	echo "i=0; while [ \$i -lt $2 ]; do $1; i=\$((i + 1)); done"
+}
+
+run() {
+	label=$1
+	count=$2
+	script=$3
+	start=$(date +%s%N)
+	"$SHELLINGTON" --no-rc -c "$script" || exit 1
+	end=$(date +%s%N)
+	ms=$(((end - start) / 1000000))
+	echo "$label: $count calls in $ms ms"
+}
+
+run "builtin test" 100000 "$(calls 'test -d /' 100000)"
+run "command test" "$EXTERNAL" "$(calls 'command test -d /' "$EXTERNAL")"
@@ -0,0 +1,358 @@
+#!/usr/bin/env python3
+"""Drives shellington through a pseudo-terminal the way a user at the keyboard would, checks
+that what comes back is right and times it. Results are written as JSON so runs of different
+releases can be compared with --compare.
+
+usage: bench/pty_bench.py [--shell PATH] [--out FILE] [--quick] [--compare OLD.json] [--tolerance 0.25]
+"""
+import argparse
+import json
+import os
+import platform
+import pty
+import select
+import shutil
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+PROMPT = b"shellington$ "
+# what the sanitizer build prints when it finds something, in the shell or in a child it forked
+SANITIZER_REPORTS = [b"ERROR: AddressSanitizer", b"ERROR: LeakSanitizer", b"runtime error:"]
+
+
+class Session:
+    """One interactive shell on a pty, started in its own HOME and working directory."""
+
+    def __init__(self, shell, home, cwd):
+        self.shell, self.home, self.cwd = shell, home, cwd
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            os.chdir(cwd)
+            os.environ["HOME"] = home
+            os.environ["TERM"] = "dumb"
+            os.execv(shell, [shell, "--no-rc"])
+        self.buffer = b""
+        self.log = b""  # everything read, checked for sanitizer reports when the session ends
+        self.expect(PROMPT, timeout=10)
+
+    def send(self, data):
+        os.write(self.fd, data)
+
+    def expect(self, pattern, timeout=30):
+        """Read until pattern shows up, return what came before it"""
+        deadline = time.monotonic() + timeout
+        while pattern not in self.buffer:
+            left = deadline - time.monotonic()
+            if left <= 0:
+                raise TimeoutError("waiting for %r, got %r" % (pattern, self.buffer[-200:]))
+            ready, _, _ = select.select([self.fd], [], [], left)
+            if ready:
+                try:
+                    chunk = os.read(self.fd, 65536)
+                except OSError:
+                    chunk = b""
+                if not chunk:
+                    raise EOFError("shell exited, last output %r" % self.buffer[-200:])
+                self.buffer += chunk
+                self.log += chunk
+        before, _, self.buffer = self.buffer.partition(pattern)
+        return before
+
+    def run(self, line, timeout=60):
+        """Type a line and Enter, return its output and the seconds until the next prompt"""
+        start = time.perf_counter()
+        self.send(line.encode() + b"\n")
+        out = self.expect(PROMPT, timeout)
+        elapsed = time.perf_counter() - start
+        echoed = line.encode() + b"\r\n"
+        return out[out.find(echoed) + len(echoed):] if echoed in out else out, elapsed
+
+    def close(self):
+        """End the shell with Ctrl-D, return the sanitizer report it or its children printed, if any"""
+        try:
+            self.send(b"\x04")
+            # leaks are reported at exit, so read until the terminal closes
+            while select.select([self.fd], [], [], 10)[0]:
+                chunk = os.read(self.fd, 65536)
+                if not chunk:
+                    break
+                self.log += chunk
+        except OSError:
+            pass
+        try:
+            os.waitpid(self.pid, 0)
+        except OSError:
+            pass
+        os.close(self.fd)
+        for marker in SANITIZER_REPORTS:
+            if marker in self.log:
+                start = self.log.find(marker)
+                return self.log[start:start + 600].decode(errors="replace")
+        return None
+
+
+def summary(samples, unit, scale=1e6):
+    samples = sorted(s * scale for s in samples)
+    return {
+        "value": round(statistics.median(samples), 1),
+        "p95": round(samples[int(len(samples) * 0.95) - 1], 1),
+        "mean": round(statistics.mean(samples), 1),
+        "samples": len(samples),
+        "unit": unit,
+        "better": "lower",
+    }
+
+
+# each scenario gets a fresh session and returns its metrics; a failed check raises
+def prompt_roundtrip(session, n, work):
+    samples = []
+    for _ in range(n):
+        start = time.perf_counter()
+        session.send(b"\n")
+        session.expect(PROMPT)
+        samples.append(time.perf_counter() - start)
+    return {"prompt_roundtrip": summary(samples, "us")}
+
+
+def keystroke_echo(session, n, work):
+    samples = []
+    for _ in range(n):
+        start = time.perf_counter()
+        session.send(b"a")
+        session.expect(b"a")
+        samples.append(time.perf_counter() - start)
+        session.send(b"\x7f")
+        session.expect(b"\x08 \x08")
+    return {"keystroke_echo": summary(samples, "us")}
+
+
+def launch_rate(session, n, work):
+    out, elapsed = session.run("for i in $(seq 1 %d); do /bin/true; done; echo launched" % n)
+    check(b"launched" in out, "launch loop did not finish: %r" % out[-200:])
+    return {"launch_rate": {"value": round(n / elapsed, 1), "unit": "commands/s", "better": "higher", "commands": n}}
+
+
+def pipeline_throughput(session, n, work):
+    size = n * 1024 * 1024
+    out, elapsed = session.run("head -c %d /dev/zero | cat | cat | wc -c" % size)
+    check(str(size).encode() in out, "pipeline lost bytes: %r" % out)
+    return {"pipeline_throughput": {"value": round(n / elapsed, 1), "unit": "MiB/s", "better": "higher", "mib": n}}
+
+
+def short_jump(session, n, work):
+    samples = []
+    targets = ["last", "alias%d" % (STORE_SIZE // 2)]
+    for i in range(n):
+        _, elapsed = session.run("short jump " + targets[i % 2])
+        samples.append(elapsed)
+    out, _ = session.run("short jump last; pwd")
+    check(out.strip().endswith(os.path.join(work, "jump", "target").encode()), "short jump went to %r" % out)
+    return {"short_jump": dict(summary(samples, "us"), store=STORE_SIZE)}
+
+
+def bookmark_run(session, n, work):
+    samples = []
+    for i in range(n):
+        index = STORE_SIZE - 1 - i % 100
+        out, elapsed = session.run("bookmark -i %d" % index)
+        check(b"bm%d ok" % index in out, "bookmark -i %d printed %r" % (index, out))
+        samples.append(elapsed)
+    return {"bookmark_run": dict(summary(samples, "us"), store=STORE_SIZE)}
+
+
+def pingsweep_loopback(session, n, work):
+    ping = shutil.which("ping")
+    if ping is None or subprocess.run([ping, "-c", "1", "-W", "1", "127.0.0.1"], capture_output=True).returncode != 0:
+        return {"pingsweep_loopback": {"skipped": "ping cannot reach 127.0.0.1 here"}}
+    out, elapsed = session.run("pingsweep 127.0.0 1 %d" % n, timeout=120)
+    check(b"127.0.0.1" in out, "pingsweep did not report 127.0.0.1: %r" % out[-300:])
+    return {"pingsweep_loopback": {"value": round(elapsed * 1e3, 1), "unit": "ms", "better": "lower", "hosts": n}}
+
+
+# lines typed into one session and what their output has to contain
+FUNCTIONAL = [
+    ("echo hello world", b"hello world"),
+    ("echo a b | tr a-z A-Z", b"A B"),
+    ("X=5; echo ${X:-none} $((X * 3))", b"5 15"),
+    ("false || echo recovered && echo chained", b"recovered\r\nchained"),
+    ("for i in 1 2 3; do printf '%s-' $i; done; echo", b"1-2-3-"),
+    ("if test 2 -gt 1; then echo bigger; else echo smaller; fi", b"bigger"),
+    ("case abc in a*) echo starts-a;; *) echo other;; esac", b"starts-a"),
+    ("f() { echo in-f $1; }; f arg", b"in-f arg"),
+    ("alias greet='echo hi from alias'; greet", b"hi from alias"),
+    ("echo $(echo nested $(echo twice))", b"nested twice"),
+    ("cat < <(echo via-procsub)", b"via-procsub"),
+    ("X=7; cat <<EOF\nx is $X \"$((X + 1))\"\nEOF", b'x is 7 "8"'),
+    ("tr a-z A-Z <<'EOF'\nliteral $X\nEOF", b"LITERAL $X"),
+    ("printf 'tr a-z A-Z <<-EOF\\n\\t\\tstripped $X\\n\\tEOF\\n' > dash.sh; . dash.sh | sed s/^/:/", b":STRIPPED 7"),
+    ("tr a-z A-Z <<< \"here $X\"", b"HERE 7"),
+    ("printf 'wc -c <<EOF\\n%s\\nEOF\\n' $(head -c 100000 /dev/zero | tr '\\0' x) > big.sh; . big.sh", b"100001"),
+    ("pmkdir -p pm/a/b pm/c; ls -ld pm/a/b pm/c | cut -c1-10 | tr '\\n' ' '", b"drwx------ drwx------"),
+    ("record start rec.shr", b""),
+    ("echo rec-$((6 * 7))", b"rec-42"),
+    ("record stop", b""),
+    ("replay -k rec.shr", b"echo rec-$((6 * 7))"),
+    ("replay -x 0 rec.shr | tr a-z A-Z", b"REC-42"),
+    ("SHELLINGTON_CGROUP= limit --files 8 sh -c 'echo files=$(ulimit -n)'", b"files=8"),
+    ("fuzzy -q rcvrd", b"false || echo recovered && echo chained"),
+    ("alias selfdrop='unalias selfdrop; echo dropped'; selfdrop; selfdrop", b"dropped\r\n-shellington: selfdrop: command not found"),
+    ("g() { g() { echo inner; }; echo outer; }; g; g; unset -f g", b"outer\r\ninner"),
+    ("echo $(( (-9223372036854775807 - 1) / -1 )) rem=$(( (-9223372036854775807 - 1) % -1 ))",
+     b"-9223372036854775808 rem=0"),
+    ("X=1; echo shift=$(( 1 << 70 )) $(( X <<= 65 ))", b"shift=64 2"),
+    ("X=$(( -9223372036854775807 - 1 )); echo quotient=$(( X /= -1 ))", b"quotient=-9223372036854775808"),
+    ("( cd /; pwd ); echo sub-done", b"/\r\nsub-done"),
+    ("history 2", b"( cd /; pwd ); echo sub-done"),
+]
+
+
+def functional(session, n, work):
+    for line, expected in FUNCTIONAL:
+        out, _ = session.run(line)
+        check(expected in out, "%r printed %r, expected %r" % (line, out, expected))
+    # a backgrounded alias has to give the prompt back before its body finishes
+    line = "alias nap='sleep 2'; nap &"
+    _, elapsed = session.run(line)
+    check(elapsed < 1, "%r held the prompt for %.1f s" % (line, elapsed))
+    return {"functional_checks": {"value": len(FUNCTIONAL) + 1, "unit": "passed", "better": "higher"}}
+
+
+def history_sync(session, n, work):
+    """Lines run in one shell show up in the history of another through the shared ring"""
+    other = Session(session.shell, session.home, session.cwd)
+    try:
+        for i in range(n):
+            session.run("echo ring-%d" % i)
+        out, elapsed = other.run("history %d" % (n + 1))
+        missing = [i for i in range(n) if b"echo ring-%d\r\n" % i not in out]
+        check(not missing, "lines %r of the other shell missing from %r" % (missing[:5], out[-300:]))
+    finally:
+        report = other.close()
+    check(report is None, "second shell: %s" % report)
+    return {"history_sync": {"value": round(elapsed * 1e6, 1), "unit": "us", "better": "lower", "lines": n}}
+
+
+SCENARIOS = [
+    # name, iterations, iterations with --quick
+    (functional, 1, 1),
+    (history_sync, 1000, 50),
+    (prompt_roundtrip, 500, 50),
+    (keystroke_echo, 500, 50),
+    (launch_rate, 2000, 200),
+    (pipeline_throughput, 256, 16),
+    (short_jump, 200, 20),
+    (bookmark_run, 100, 10),
+    (pingsweep_loopback, 4, 2),
+]
+STORE_SIZE = 10000
+
+
+class CheckFailed(Exception):
+    pass
+
+
+def check(condition, message):
+    if not condition:
+        raise CheckFailed(message)
+
+
+def make_stores(work):
+    """The short and bookmark files of STORE_SIZE entries, in the directory the shell starts in"""
+    os.makedirs(os.path.join(work, "jump", "target"))
+    with open(os.path.join(work, "shorttxt"), "w") as f:
+        for i in range(STORE_SIZE - 1):
+            f.write("alias%d:%s\n" % (i, os.path.join(work, "jump")))
+        f.write("last:%s\n" % os.path.join(work, "jump", "target"))
+    with open(os.path.join(work, "bookmarktxt"), "w") as f:
+        for i in range(STORE_SIZE):
+            f.write('%d "echo bm%d ok"\n' % (i, i))
+
+
+def revision():
+    try:
+        return subprocess.run(["git", "describe", "--always", "--dirty"], capture_output=True, text=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__))).stdout.strip() or None
+    except OSError:
+        return None
+
+
+def compare(results, old, tolerance):
+    """Print every metric next to the old run, return the names that got worse than tolerance"""
+    worse = []
+    for name, metric in sorted(results["metrics"].items()):
+        before = old.get("metrics", {}).get(name, {})
+        if "value" not in metric or "value" not in before or not before["value"]:
+            continue
+        ratio = metric["value"] / before["value"]
+        bad = ratio > 1 + tolerance if metric.get("better") == "lower" else ratio < 1 - tolerance
+        print("%-22s %12s -> %-12s %s %+.1f%%%s" % (name, before["value"], metric["value"], metric.get("unit", ""),
+                                                   (ratio - 1) * 100, "  REGRESSION" if bad else ""))
+        if bad:
+            worse.append(name)
+    return worse
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--shell", default="./shellington")
+    parser.add_argument("--out", default="bench/results.json")
+    parser.add_argument("--quick", action="store_true", help="few iterations, for the regression run")
+    parser.add_argument("--compare", help="results of an earlier run")
+    parser.add_argument("--tolerance", type=float, default=0.25, help="slowdown allowed by --compare")
+    args = parser.parse_args()
+    shell = os.path.abspath(args.shell)
+
+    results = {
+        "schema": 1,
+        "shell": args.shell,
+        "revision": revision(),
+        "quick": args.quick,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+        "host": {"system": platform.system(), "release": platform.release(), "machine": platform.machine(),
+                 "cpus": os.cpu_count()},
+        "metrics": {},
+        "failures": [],
+    }
+    signal.signal(signal.SIGPIPE, signal.SIG_DFL)
+    with tempfile.TemporaryDirectory(prefix="shellington-bench-") as work:
+        home = os.path.join(work, "home")
+        os.mkdir(home)
+        make_stores(work)
+        for scenario, iterations, quick_iterations in SCENARIOS:
+            name = scenario.__name__
+            session = None
+            try:
+                session = Session(shell, home, work)
+                metrics = scenario(session, quick_iterations if args.quick else iterations, work)
+                results["metrics"].update(metrics)
+                for metric, values in metrics.items():
+                    shown = values.get("skipped") or "%s %s" % (values["value"], values["unit"])
+                    print("%-22s %s" % (metric, shown))
+            except (CheckFailed, TimeoutError, EOFError) as error:
+                results["failures"].append({"scenario": name, "error": str(error)})
+                print("%-22s FAILED: %s" % (name, error))
+            finally:
+                report = session.close() if session is not None else None
+                if report is not None:
+                    results["failures"].append({"scenario": name, "error": report})
+                    print("%-22s SANITIZER: %s" % (name, report))
+
+    os.makedirs(os.path.dirname(os.path.abspath(args.out)), exist_ok=True)
+    with open(args.out, "w") as f:
+        json.dump(results, f, indent=2)
+        f.write("\n")
+    print("results written to %s" % args.out)
+
+    worse = []
+    if args.compare:
+        with open(args.compare) as f:
+            worse = compare(results, json.load(f), args.tolerance)
+    return 1 if results["failures"] or worse else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -6,6 +7,30 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define FUZZY_AVX2 // built in any case, used when the CPU has it
+#endif
 
 //For use in short function
 #define BUF_SIZE 250
@@ -15,6 +40,21 @@ char w[BUF_SIZE];
 
 const char *sysname = "shellington";
 
+// startup configuration lives in the home directory, the snapshot is the compiled image of it
+#define RC_FILE ".shellingtonrc"
+#define SNAPSHOT_FILE ".shellingtonrc.snap"
+#define SNAPSHOT_MAGIC "SHLSNAP"
+#define SNAPSHOT_VERSION 4
+
+// exit status of the last foreground command
+int last_status = 0;
+
+// set while running the last command of a forked child, the exec then replaces the child instead of forking again
+bool no_fork = false;
+
+// the working directory, opened by the builtins that work relative to it and closed again by cd
+int cwd_fd = -1;
+
 enum return_codes
 {
 	SUCCESS = 0,
@@ -28,9 +68,115 @@ struct command_t
 	bool auto_complete;
 	int arg_count;
 	char **args;
-	char *redirects[3];		// in/out redirection
-	struct command_t *next; // for piping
+	char *redirects[3]; // in/out redirection
+	int assignment_count;
+	char **assignments; // NAME=value words in front of the command
+};
+
+// a parsed command line; simple commands are leaves that keep their words unexpanded
+enum node_type
+{
+	NODE_COMMAND,	 // command
+	NODE_LIST,		 // children run one after another
+	NODE_AND,		 // left && right
+	NODE_OR,		 // left || right
+	NODE_NOT,		 // ! child
+	NODE_PIPELINE,	 // children connected by pipes
+	NODE_SUBSHELL,	 // ( child ), runs in a forked shell
+	NODE_GROUP,		 // { child; }, runs in this shell
+	NODE_BACKGROUND, // child &
+	NODE_FUNCTION,	 // name() child
+	NODE_IF,		 // if left then child else right, right is another NODE_IF for elif
+	NODE_WHILE,		 // while left do child done
+	NODE_UNTIL,		 // until left do child done
+	NODE_FOR,		 // for name in words do child done
+	NODE_CASE,		 // case name in children esac
+	NODE_PATTERN,	 // words) child ;; one branch of a case
+};
+struct node_t
+{
+	enum node_type type;
+	struct command_t *command;
+	struct node_t **children;
+	int child_count;
+	struct node_t *child;
+	struct node_t *left, *right;
+	char *redirects[3]; // redirections of a subshell or group
+	char *name;			// function name, loop variable or case subject
+	char *text;			// function source text
+	char **words;		// words of a for loop, patterns of a case branch
+	int word_count;
+};
+
+// an alias or a shell function, kept as an already parsed tree that is cloned or walked on every use
+#define DEFINITION_BUCKETS 64
+#define MAX_FUNCTION_DEPTH 100
+struct definition_t
+{
+	char *name;
+	char *text;			 // source text, used for listings
+	struct node_t *body; // NULL for an empty alias
+	bool expanding;		 // recursion guard for aliases
+	int depth;			 // active calls of a function
+	bool removed;		 // unset or redefined while in use, freed once the last use returns
+	struct definition_t *next;
+};
+struct definition_t *alias_table[DEFINITION_BUCKETS];
+struct definition_t *function_table[DEFINITION_BUCKETS];
+
+// a builtin run by process_command() without forking
+struct builtin_t
+{
+	const char *name;
+	int (*run)(struct command_t *command);
 };
+
+// shell variables; exported ones make up the environment handed to execve
+#define VARIABLE_BUCKETS 256
+struct variable_t
+{
+	char *entry;		// "NAME=value", the form environ uses
+	const char *value;	// points into entry
+	int name_len;
+	bool exported;
+	struct variable_t *next;
+};
+struct variable_t *variable_table[VARIABLE_BUCKETS];
+char **environ_cache = NULL; // exported entries, rebuilt only after an export changed
+bool environ_dirty = true;
+
+// break, continue and return unwind the running lists until a loop or the function takes them
+int loop_depth = 0;
+int pending_break = 0;	  // loops still to leave
+int pending_continue = 0; // loops to leave, the last one of them continues
+bool pending_return = false;
+int function_depth = 0;
+
+// positional parameters of the innermost running function
+int positional_count = 0;
+char **positional = NULL;
+
+// growable byte buffer
+struct byte_buf
+{
+	char *data;
+	size_t len, cap;
+};
+
+size_t buf_append(struct byte_buf *b, const void *data, size_t len)
+{
+	if (b->len + len > b->cap)
+	{
+		while (b->len + len > b->cap)
+			b->cap = b->cap ? b->cap * 2 : 64;
+		b->data = realloc(b->data, b->cap);
+	}
+	size_t off = b->len;
+	if (len > 0) // an empty line appended to an empty buffer has no memory on either side
+		memcpy(b->data + off, data, len);
+	b->len += len;
+	return off;
+}
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -44,14 +190,12 @@ void print_command(struct command_t *command)
 	printf("\tRedirects:\n");
 	for (i = 0; i < 3; i++)
 		printf("\t\t%d: %s\n", i, command->redirects[i] ? command->redirects[i] : "N/A");
+	printf("\tAssignments (%d):\n", command->assignment_count);
+	for (i = 0; i < command->assignment_count; ++i)
+		printf("\t\t%s\n", command->assignments[i]);
 	printf("\tArguments (%d):\n", command->arg_count);
 	for (i = 0; i < command->arg_count; ++i)
 		printf("\t\tArg %d: %s\n", i, command->args[i]);
-	if (command->next)
-	{
-		printf("\tPiped to:\n");
-		print_command(command->next);
-	}
 }
 /**
  * Release allocated memory of a command
@@ -60,24 +204,33 @@ void print_command(struct command_t *command)
  */
 int free_command(struct command_t *command)
 {
-	if (command->arg_count)
-	{
-		for (int i = 0; i < command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
-	}
+	for (int i = 0; i < command->arg_count; ++i)
+		free(command->args[i]);
+	free(command->args);
 	for (int i = 0; i < 3; ++i)
 		if (command->redirects[i])
 			free(command->redirects[i]);
-	if (command->next)
-	{
-		free_command(command->next);
-		command->next = NULL;
-	}
+	for (int i = 0; i < command->assignment_count; ++i)
+		free(command->assignments[i]);
+	free(command->assignments);
 	free(command->name);
 	free(command);
 	return 0;
 }
+const char *get_variable(const char *name);
+enum fuzzy_source
+{
+	FUZZY_HISTORY = 1,
+	FUZZY_MARKS = 2, // bookmarks and shortcuts
+	FUZZY_ALL = 3,
+};
+
+bool fuzzy_select(int sources, const char *query, char *out, size_t out_size);
+void record_input(const char *data, int len);
+void record_track_size();
+extern char **history_lines;
+extern int history_count;
+
 /**
  * Show the command prompt
  * @return [description]
@@ -87,519 +240,6619 @@ int show_prompt()
 	char cwd[1024], hostname[1024];
 	gethostname(hostname, sizeof(hostname));
 	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+	const char *user = get_variable("USER");
+	printf("%s@%s:%s %s$ ", user ? user : "", hostname, cwd, sysname);
 	return 0;
 }
-/**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
- */
-int parse_command(char *buf, struct command_t *command)
-{
-	const char *splitters = " \t"; // split at whitespace
-	int index, len;
-	len = strlen(buf);
-	while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-	{
-		buf++;
-		len--;
-	}
-	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-		buf[--len] = 0; // trim right whitespace
+/// Parser: the input is tokenized and turned into an AST of lists, and-or chains, pipelines,
+/// subshells, groups and function definitions. Words keep their quotes until expansion.
 
-	if (len > 0 && buf[len - 1] == '?') // auto-complete
-		command->auto_complete = true;
-	if (len > 0 && buf[len - 1] == '&') // background
-		command->background = true;
+enum token_type
+{
+	TOKEN_WORD,
+	TOKEN_PIPE,	   // |
+	TOKEN_AND,	   // &&
+	TOKEN_OR,	   // ||
+	TOKEN_SEMI,	   // ;
+	TOKEN_DSEMI,   // ;;
+	TOKEN_AMP,	   // &
+	TOKEN_LPAREN,  // (
+	TOKEN_RPAREN,  // )
+	TOKEN_NEWLINE, // \n
+	TOKEN_LESS,	   // <
+	TOKEN_GREAT,   // >
+	TOKEN_DGREAT,  // >>
+	TOKEN_DLESS,   // <<
+	TOKEN_DLESSDASH, // <<-
+	TOKEN_TLESS,   // <<<
+	TOKEN_END,
+};
+enum parse_status
+{
+	PARSE_OK = 0,
+	PARSE_INCOMPLETE = 1, // more input is needed, e.g. an open quote or a trailing &&
+	PARSE_ERROR = 2,
+};
+// a << redirection whose body starts on the line after the operator
+struct pending_heredoc
+{
+	char **slot;	 // redirects[0] of its command, NULL once another < replaced it
+	char *delimiter; // quotes removed
+	bool literal;	 // the delimiter was quoted, the body is not expanded
+	bool strip_tabs; // <<-
+};
+struct parser_t
+{
+	const char *input;
+	const char *pos;
+	const char *token_start;
+	enum token_type type;
+	char *word; // text of the current TOKEN_WORD, quotes included
+	int status;
+	struct pending_heredoc *heredocs; // read when the line they are on ends
+	int heredoc_count;
+};
 
-	char *pch = strtok(buf, splitters);
-	command->name = (char *)malloc(strlen(pch) + 1);
-	if (pch == NULL)
-		command->name[0] = 0;
-	else
-		strcpy(command->name, pch);
+// first byte of a redirects[0] that is not a file name but a heredoc or here-string
+#define HEREDOC_LITERAL '\001' // body as written
+#define HEREDOC_EXPAND '\002'	// body gets parameter, command and arithmetic expansion
+#define HERESTRING '\003'		// the word after <<<, expanded when the command runs
 
-	command->args = (char **)malloc(sizeof(char *));
+bool is_heredoc(const char *redirect)
+{
+	return redirect[0] == HEREDOC_LITERAL || redirect[0] == HEREDOC_EXPAND || redirect[0] == HERESTRING;
+}
 
-	int redirect_index;
-	int arg_index = 0;
-	char temp_buf[1024], *arg;
-	while (1)
+/**
+ * Skip the body of a $( ), <( ) or >( ) substitution
+ * @param  p points at the opening (
+ * @return   first character after the matching ), NULL if it is not closed yet
+ */
+const char *skip_parens(const char *p)
+{
+	int depth = 0;
+	for (; *p; p++)
 	{
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch)
-			break;
-		arg = temp_buf;
-		strcpy(arg, pch);
-		len = strlen(arg);
-
-		if (len == 0)
-			continue;										 // empty arg, go for next
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-		{
-			arg++;
-			len--;
-		}
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-			arg[--len] = 0; // trim right whitespace
-		if (len == 0)
-			continue; // empty arg, go for next
-
-		// piping to another command
-		if (strcmp(arg, "|") == 0)
-		{
-			struct command_t *c = malloc(sizeof(struct command_t));
-			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
-			index = 1;
-			while (pch[index] == ' ' || pch[index] == '\t')
-				index++; // skip whitespaces
-
-			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
-			command->next = c;
-			continue;
+		if (*p == '\\' && p[1])
+			p++;
+		else if (*p == '\'')
+		{
+			p = strchr(p + 1, '\'');
+			if (p == NULL)
+				return NULL;
 		}
-
-		// background process
-		if (strcmp(arg, "&") == 0)
-			continue; // handled before
-
-		// handle input redirection
-		redirect_index = -1;
-		if (arg[0] == '<')
-			redirect_index = 0;
-		if (arg[0] == '>')
+		else if (*p == '"')
 		{
-			if (len > 1 && arg[1] == '>')
+			for (p++; *p && *p != '"'; p++)
 			{
-				redirect_index = 2;
-				arg++;
-				len--;
+				if (*p == '\\' && p[1])
+					p++;
+				else if (*p == '$' && p[1] == '(')
+				{
+					p = skip_parens(p + 1);
+					if (p == NULL)
+						return NULL;
+					p--;
+				}
 			}
-			else
-				redirect_index = 1;
-		}
-		if (redirect_index != -1)
-		{
-			command->redirects[redirect_index] = malloc(len);
-			strcpy(command->redirects[redirect_index], arg + 1);
-			continue;
-		}
-
-		// normal arguments
-		if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"') || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-		{
-			arg[--len] = 0;
-			arg++;
+			if (*p == 0)
+				return NULL;
 		}
-		command->args = (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-		command->args[arg_index] = (char *)malloc(len + 1);
-		strcpy(command->args[arg_index++], arg);
+		else if (*p == '(')
+			depth++;
+		else if (*p == ')' && --depth == 0)
+			return p + 1;
 	}
-	command->arg_count = arg_index;
-	return 0;
+	return NULL;
 }
-void prompt_backspace()
+
+// first character after a backquoted command, NULL if it is not closed yet
+const char *skip_backquote(const char *p)
 {
-	putchar(8);	  // go back 1
-	putchar(' '); // write empty over
-	putchar(8);	  // go back 1 again
+	for (p++; *p && *p != '`'; p++)
+		if (*p == '\\' && p[1])
+			p++;
+	return *p ? p + 1 : NULL;
 }
+
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Find the end of a word, honoring quotes, backslashes and substitutions
+ * @param  p [description]
+ * @return   first character after the word, NULL if a quote is still open
  */
-int prompt(struct command_t *command)
+const char *scan_word(const char *p)
 {
-	int index = 0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
-
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-	// ICANON normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-	//FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state = 0;
-	buf[0] = 0;
-	while (1)
+	while (*p)
 	{
-		c = getchar();
-		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-		if (c == 9) // handle tab
+		if ((*p == '$' || *p == '<' || *p == '>') && p[1] == '(')
 		{
-			buf[index++] = '?'; // autocomplete
+			p = skip_parens(p + 1);
+			if (p == NULL)
+				return NULL;
+		}
+		else if (strchr(" \t\n|&;()<>", *p) != NULL)
 			break;
+		else if (*p == '\\')
+		{
+			if (p[1] == 0)
+				return NULL;
+			p += 2;
 		}
-
-		if (c == 127) // handle backspace
+		else if (*p == '\'')
 		{
-			if (index > 0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			continue;
+			p = strchr(p + 1, '\'');
+			if (p == NULL)
+				return NULL;
+			p++;
 		}
-		if (c == 27 && multicode_state == 0) // handle multi-code keys
+		else if (*p == '"')
 		{
-			multicode_state = 1;
-			continue;
+			for (p++; p && *p && *p != '"'; p++)
+			{
+				if (*p == '\\' && p[1])
+					p++;
+				else if (*p == '$' && p[1] == '(' && (p = skip_parens(p + 1)) != NULL)
+					p--;
+				else if (*p == '`' && (p = skip_backquote(p)) != NULL)
+					p--;
+			}
+			if (p == NULL || *p == 0)
+				return NULL;
+			p++;
 		}
-		if (c == 91 && multicode_state == 1)
+		else if (*p == '`')
 		{
-			multicode_state = 2;
-			continue;
+			p = skip_backquote(p);
+			if (p == NULL)
+				return NULL;
 		}
-		if (c == 65 && multicode_state == 2) // up arrow
+		else
+			p++;
+	}
+	return p;
+}
+
+/**
+ * Collect the bodies of the heredocs opened on the line that just ended, up to their delimiter lines
+ * @param p positioned at the start of the next line
+ */
+void read_heredocs(struct parser_t *p)
+{
+	for (int i = 0; i < p->heredoc_count && p->status == PARSE_OK; i++)
+	{
+		struct pending_heredoc *h = &p->heredocs[i];
+		size_t delimiter_len = strlen(h->delimiter);
+		struct byte_buf body = {0};
+		char kind = h->literal ? HEREDOC_LITERAL : HEREDOC_EXPAND;
+		buf_append(&body, &kind, 1);
+		bool found = false;
+		while (*p->pos && !found)
 		{
-			int i;
-			while (index > 0)
-			{
-				prompt_backspace();
-				index--;
-			}
-			for (i = 0; oldbuf[i]; ++i)
+			const char *line = p->pos;
+			const char *end = strchr(line, '\n');
+			size_t len = end ? (size_t)(end - line) : strlen(line);
+			p->pos = line + len + (end != NULL);
+			if (h->strip_tabs)
+				for (; len > 0 && *line == '\t'; len--)
+					line++;
+			found = len == delimiter_len && memcmp(line, h->delimiter, len) == 0;
+			if (!found)
 			{
-				putchar(oldbuf[i]);
-				buf[i] = oldbuf[i];
+				buf_append(&body, line, len);
+				buf_append(&body, "\n", 1);
 			}
-			index = i;
-			continue;
 		}
-		else
-			multicode_state = 0;
+		buf_append(&body, "", 1);
+		if (!found)
+			p->status = PARSE_INCOMPLETE; // the delimiter is on a line not typed yet
+		else if (h->slot != NULL)
+		{
+			free(*h->slot);
+			*h->slot = body.data;
+			body.data = NULL;
+		}
+		free(body.data);
+	}
+	for (int i = 0; i < p->heredoc_count; i++)
+		free(p->heredocs[i].delimiter);
+	p->heredoc_count = 0;
+}
 
-		putchar(c); // echo the character
-		buf[index++] = c;
-		if (index >= sizeof(buf) - 1)
-			break;
-		if (c == '\n') // enter key
+void next_token(struct parser_t *p)
+{
+	free(p->word);
+	p->word = NULL;
+	while (1)
+	{
+		while (*p->pos == ' ' || *p->pos == '\t')
+			p->pos++;
+		if (p->pos[0] == '\\' && p->pos[1] == '\n') // line continuation
+			p->pos += 2;
+		else if (*p->pos == '#') // comment up to the end of the line
+			while (*p->pos && *p->pos != '\n')
+				p->pos++;
+		else
 			break;
-		if (c == 4) // Ctrl+D
-			return EXIT;
 	}
-	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-		index--;
-	buf[index++] = 0; // null terminate string
-
-	strcpy(oldbuf, buf);
+	p->token_start = p->pos;
 
-	parse_command(buf, command);
-
-	// print_command(command); // DEBUG: uncomment for debugging
+	const char *s = p->pos;
+	bool substitution = (*s == '<' || *s == '>') && s[1] == '('; // <( ) and >( ) are words
+	switch (substitution ? 'w' : *s)
+	{
+	case 0:
+		p->type = TOKEN_END;
+		if (p->heredoc_count > 0 && p->status == PARSE_OK)
+			p->status = PARSE_INCOMPLETE;
+		return;
+	case '\n':
+		p->type = TOKEN_NEWLINE;
+		p->pos++;
+		if (p->heredoc_count > 0)
+		{
+			read_heredocs(p);
+			if (p->status != PARSE_OK)
+			{
+				p->type = TOKEN_END;
+				p->pos += strlen(p->pos);
+			}
+		}
+		return;
+	case '|':
+		p->type = s[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+		break;
+	case '&':
+		p->type = s[1] == '&' ? TOKEN_AND : TOKEN_AMP;
+		break;
+	case ';':
+		p->type = s[1] == ';' ? TOKEN_DSEMI : TOKEN_SEMI;
+		break;
+	case '(':
+		p->type = TOKEN_LPAREN;
+		break;
+	case ')':
+		p->type = TOKEN_RPAREN;
+		break;
+	case '<':
+		p->type = s[1] != '<' ? TOKEN_LESS : s[2] == '<' ? TOKEN_TLESS : s[2] == '-' ? TOKEN_DLESSDASH : TOKEN_DLESS;
+		break;
+	case '>':
+		p->type = s[1] == '>' ? TOKEN_DGREAT : TOKEN_GREAT;
+		break;
+	default:
+	{
+		const char *end = scan_word(s);
+		if (end == NULL)
+		{
+			// open quote or trailing backslash, the rest of the word is on the next line
+			p->status = PARSE_INCOMPLETE;
+			p->type = TOKEN_END;
+			p->pos += strlen(p->pos);
+			return;
+		}
+		p->type = TOKEN_WORD;
+		p->word = strndup(s, end - s);
+		p->pos = end;
+		return;
+	}
+	}
+	if (p->type == TOKEN_TLESS || p->type == TOKEN_DLESSDASH)
+		p->pos += 3;
+	else
+		p->pos += (p->type == TOKEN_OR || p->type == TOKEN_AND || p->type == TOKEN_DGREAT || p->type == TOKEN_DLESS || p->type == TOKEN_DSEMI) ? 2 : 1;
+}
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-	return SUCCESS;
+bool token_is_word(struct parser_t *p, const char *word)
+{
+	return p->type == TOKEN_WORD && strcmp(p->word, word) == 0;
 }
-int process_command(struct command_t *command);
 
-// Added predefinitions for file_exists and search_path
-int file_exists(const char *file_name);
-char *search_path(const char *file_name);
+void syntax_error(struct parser_t *p)
+{
+	if (p->status != PARSE_OK)
+		return;
+	if (p->type == TOKEN_END)
+	{
+		// running out of input where more is expected only means the command continues on the next line
+		p->status = PARSE_INCOMPLETE;
+		return;
+	}
+	p->status = PARSE_ERROR;
+	int len = p->type == TOKEN_WORD ? (int)strlen(p->word) : (p->type == TOKEN_NEWLINE ? 0 : (int)(p->pos - p->token_start));
+	printf("-%s: syntax error near unexpected token '%.*s'\n", sysname, len ? len : 7, len ? p->token_start : "newline");
+}
 
-const char *search_short(FILE *fp, const char *alias); // will return the alias token's corresponding file output
-void jump_to(const char *loc, struct command_t *command);
-int shortcut(struct command_t *command);
+void skip_newlines(struct parser_t *p)
+{
+	while (p->type == TOKEN_NEWLINE)
+		next_token(p);
+}
 
-void bookmark(struct command_t *command);
-void save(FILE *fp, char *argv, int save1);
-void library(FILE *fp);
+struct node_t *new_node(enum node_type type)
+{
+	struct node_t *node = malloc(sizeof(struct node_t));
+	memset(node, 0, sizeof(struct node_t));
+	node->type = type;
+	return node;
+}
 
-void remindme(struct command_t *command);
+void add_child(struct node_t *node, struct node_t *child)
+{
+	node->children = realloc(node->children, sizeof(struct node_t *) * (node->child_count + 1));
+	node->children[node->child_count++] = child;
+}
 
-int ping_sweep(const char *subnet_command, const char *start_command, const char *end_command);
-void private_dir(struct command_t* command); 
+struct node_t *parse_list(struct parser_t *p);
 
-int main()
+// words that close a list instead of starting a command
+bool at_list_end(struct parser_t *p)
 {
-	// Get the first working directory to W
-	getcwd(w, sizeof(w));
+	static const char *closing[] = {"}", "then", "elif", "else", "fi", "do", "done", "esac", NULL};
+	if (p->type == TOKEN_END || p->type == TOKEN_RPAREN || p->type == TOKEN_DSEMI)
+		return true;
+	for (int i = 0; p->type == TOKEN_WORD && closing[i]; i++)
+		if (strcmp(p->word, closing[i]) == 0)
+			return true;
+	return false;
+}
 
-	while (1)
+// consume a reserved word the grammar requires here
+bool expect_word(struct parser_t *p, const char *word)
+{
+	if (p->status != PARSE_OK)
+		return false;
+	if (!token_is_word(p, word))
 	{
-		struct command_t *command = malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-
-		int code;
-		code = prompt(command);
-		if (code == EXIT)
-			break;
-
-		code = process_command(command);
-		if (code == EXIT)
-			break;
-
-		free_command(command);
+		syntax_error(p);
+		return false;
 	}
-
-	printf("\n");
-	return 0;
+	next_token(p);
+	return true;
 }
 
-int process_command(struct command_t *command)
+// a list that must not be empty, like the condition or body of a loop
+struct node_t *parse_body(struct parser_t *p)
 {
-	int r;
-	bool builtinComm = false;
+	struct node_t *list = parse_list(p);
+	if (list == NULL)
+		syntax_error(p);
+	return list;
+}
 
-	if (strcmp(command->name, "") == 0)
-		return SUCCESS;
+/**
+ * Queue the body of a << redirection, read once the line ends
+ * @param  word the delimiter as written, taken over
+ * @return      what redirects[0] holds until the body is there
+ */
+char *add_heredoc(struct parser_t *p, char **slot, char *word, bool strip_tabs)
+{
+	// any quoting in the delimiter turns expansion of the body off
+	bool literal = strpbrk(word, "'\"\\") != NULL;
+	char *delimiter = word, *out = word;
+	for (const char *q = word; *q; q++)
+	{
+		if (*q == '\'' || *q == '"')
+			continue;
+		if (*q == '\\' && q[1])
+			q++;
+		*out++ = *q;
+	}
+	*out = 0;
+	p->heredocs = realloc(p->heredocs, sizeof(struct pending_heredoc) * (p->heredoc_count + 1));
+	p->heredocs[p->heredoc_count++] = (struct pending_heredoc){slot, delimiter, literal, strip_tabs};
+	char placeholder[2] = {literal ? HEREDOC_LITERAL : HEREDOC_EXPAND, 0};
+	return strdup(placeholder);
+}
 
-	if (strcmp(command->name, "short") == 0)
+/**
+ * Parse a redirection operator and its target into a redirects array
+ * @return true if a redirection was consumed
+ */
+bool parse_redirect(struct parser_t *p, char **redirects)
+{
+	int redirect_index;
+	enum token_type op = p->type;
+	if (p->type == TOKEN_LESS || p->type == TOKEN_DLESS || p->type == TOKEN_DLESSDASH || p->type == TOKEN_TLESS)
+		redirect_index = 0;
+	else if (p->type == TOKEN_GREAT)
+		redirect_index = 1;
+	else if (p->type == TOKEN_DGREAT)
+		redirect_index = 2;
+	else
+		return false;
+	next_token(p);
+	if (p->type != TOKEN_WORD)
 	{
-		// If you jump to a location and after that immediately trigger an blank success statement,
-		// the cd reverts back to the location before jumping
-		builtinComm = true;
-		if (fork() == 0)
-		{
-			shortcut(command);
-		}
-		else
-		{
-			if (!command->background)
-				wait(0); // wait for child process to finish
-			return SUCCESS;
-		}
+		syntax_error(p);
+		return false;
 	}
-	if (strcmp(command->name, "bookmark") == 0)
+	// > and >> share stdout, the last one given wins like in other shells
+	if (redirect_index > 0)
 	{
-		builtinComm = true;
-		char *bookmark_comm_set;
+		free(redirects[1]);
+		free(redirects[2]);
+		redirects[1] = redirects[2] = NULL;
+	}
+	// so does stdin, a heredoc still waiting for its body is dropped
+	for (int i = 0; i < p->heredoc_count; i++)
+		if (p->heredocs[i].slot == &redirects[redirect_index])
+			p->heredocs[i].slot = NULL;
+	free(redirects[redirect_index]);
+	if (op == TOKEN_DLESS || op == TOKEN_DLESSDASH)
+		redirects[0] = add_heredoc(p, &redirects[0], p->word, op == TOKEN_DLESSDASH);
+	else if (op == TOKEN_TLESS)
+	{
+		redirects[0] = malloc(strlen(p->word) + 2);
+		sprintf(redirects[0], "%c%s", HERESTRING, p->word);
+		free(p->word);
+	}
+	else
+		redirects[redirect_index] = p->word;
+	p->word = NULL;
+	next_token(p);
+	return true;
+}
+
+/**
+ * ( list ) or { list; }
+ */
+struct node_t *parse_compound(struct parser_t *p)
+{
+	bool subshell = p->type == TOKEN_LPAREN;
+	next_token(p);
+	struct node_t *node = new_node(subshell ? NODE_SUBSHELL : NODE_GROUP);
+	node->child = parse_list(p);
+	if (p->status != PARSE_OK)
+		return node;
+	if (node->child == NULL || (subshell && p->type != TOKEN_RPAREN) || (!subshell && !token_is_word(p, "}")))
+	{
+		syntax_error(p);
+		return node;
+	}
+	next_token(p);
+	while (p->status == PARSE_OK && parse_redirect(p, node->redirects))
+		;
+	return node;
+}
+
+bool is_name(const char *word)
+{
+	if (!(*word == '_' || (*word >= 'a' && *word <= 'z') || (*word >= 'A' && *word <= 'Z')))
+		return false;
+	for (word++; *word; word++)
+		if (!(*word == '_' || *word == '-' || (*word >= 'a' && *word <= 'z') || (*word >= 'A' && *word <= 'Z') || (*word >= '0' && *word <= '9')))
+			return false;
+	return true;
+}
+
+// length of NAME in a NAME=value word, 0 if the word is not an assignment
+int assignment_name_length(const char *word)
+{
+	int len = 0;
+	if (!(*word == '_' || (*word >= 'a' && *word <= 'z') || (*word >= 'A' && *word <= 'Z')))
+		return 0;
+	while (word[len] == '_' || (word[len] >= 'a' && word[len] <= 'z') || (word[len] >= 'A' && word[len] <= 'Z') || (word[len] >= '0' && word[len] <= '9'))
+		len++;
+	return word[len] == '=' ? len : 0;
+}
+
+/**
+ * if list then list [elif list then list]... [else list] fi
+ */
+struct node_t *parse_if(struct parser_t *p)
+{
+	next_token(p);
+	struct node_t *node = new_node(NODE_IF);
+	node->left = parse_body(p);
+	if (!expect_word(p, "then"))
+		return node;
+	node->child = parse_body(p);
+	if (p->status != PARSE_OK)
+		return node;
+	if (token_is_word(p, "elif"))
+	{
+		// the elif branch reads the closing fi itself
+		node->right = parse_if(p);
+		return node;
+	}
+	if (token_is_word(p, "else"))
+	{
+		next_token(p);
+		node->right = parse_body(p);
+	}
+	expect_word(p, "fi");
+	return node;
+}
+
+/**
+ * while list do list done, until list do list done
+ */
+struct node_t *parse_loop(struct parser_t *p)
+{
+	struct node_t *node = new_node(token_is_word(p, "while") ? NODE_WHILE : NODE_UNTIL);
+	next_token(p);
+	node->left = parse_body(p);
+	if (!expect_word(p, "do"))
+		return node;
+	node->child = parse_body(p);
+	expect_word(p, "done");
+	return node;
+}
+
+/**
+ * for name [in word...] do list done, without in it walks the positional parameters
+ */
+struct node_t *parse_for(struct parser_t *p)
+{
+	struct node_t *node = new_node(NODE_FOR);
+	next_token(p);
+	if (p->type != TOKEN_WORD || !is_name(p->word) || strchr(p->word, '-') != NULL)
+	{
+		syntax_error(p);
+		return node;
+	}
+	node->name = p->word;
+	p->word = NULL;
+	next_token(p);
+	node->words = malloc(sizeof(char *));
+	skip_newlines(p);
+	if (token_is_word(p, "in"))
+	{
+		next_token(p);
+		while (p->type == TOKEN_WORD)
+		{
+			node->words = realloc(node->words, sizeof(char *) * (node->word_count + 1));
+			node->words[node->word_count++] = p->word;
+			p->word = NULL;
+			next_token(p);
+		}
+		if (p->type != TOKEN_SEMI && p->type != TOKEN_NEWLINE)
+		{
+			syntax_error(p);
+			return node;
+		}
+		next_token(p);
+	}
+	else
+	{
+		node->words[node->word_count++] = strdup("\"$@\"");
+		if (p->type == TOKEN_SEMI)
+			next_token(p);
+	}
+	skip_newlines(p);
+	if (!expect_word(p, "do"))
+		return node;
+	node->child = parse_body(p);
+	expect_word(p, "done");
+	return node;
+}
+
+/**
+ * case word in [(]pattern[|pattern]...) list ;; ... esac
+ */
+struct node_t *parse_case(struct parser_t *p)
+{
+	struct node_t *node = new_node(NODE_CASE);
+	next_token(p);
+	if (p->type != TOKEN_WORD)
+	{
+		syntax_error(p);
+		return node;
+	}
+	node->name = p->word;
+	p->word = NULL;
+	next_token(p);
+	skip_newlines(p);
+	if (!expect_word(p, "in"))
+		return node;
+	skip_newlines(p);
+	while (p->status == PARSE_OK && !token_is_word(p, "esac"))
+	{
+		struct node_t *branch = new_node(NODE_PATTERN);
+		add_child(node, branch);
+		if (p->type == TOKEN_LPAREN)
+			next_token(p);
+		while (p->type == TOKEN_WORD)
+		{
+			branch->words = realloc(branch->words, sizeof(char *) * (branch->word_count + 1));
+			branch->words[branch->word_count++] = p->word;
+			p->word = NULL;
+			next_token(p);
+			if (p->type != TOKEN_PIPE)
+				break;
+			next_token(p);
+		}
+		if (branch->word_count == 0 || p->type != TOKEN_RPAREN)
+		{
+			syntax_error(p);
+			return node;
+		}
+		next_token(p);
+		branch->child = parse_list(p); // an empty branch is allowed
+		if (p->status != PARSE_OK)
+			return node;
+		if (p->type == TOKEN_DSEMI)
+			next_token(p);
+		else if (!token_is_word(p, "esac"))
+		{
+			syntax_error(p);
+			return node;
+		}
+		skip_newlines(p);
+	}
+	expect_word(p, "esac");
+	return node;
+}
+
+struct node_t *parse_command_node(struct parser_t *p)
+{
+	if (p->type == TOKEN_LPAREN || token_is_word(p, "{"))
+		return parse_compound(p);
+
+	// reserved words only count at the start of a command, echo if prints if
+	struct node_t *compound = NULL;
+	if (token_is_word(p, "if"))
+		compound = parse_if(p);
+	else if (token_is_word(p, "while") || token_is_word(p, "until"))
+		compound = parse_loop(p);
+	else if (token_is_word(p, "for"))
+		compound = parse_for(p);
+	else if (token_is_word(p, "case"))
+		compound = parse_case(p);
+	if (compound != NULL)
+	{
+		while (p->status == PARSE_OK && parse_redirect(p, compound->redirects))
+			;
+		return compound;
+	}
+
+	// name ( ) compound-command defines a function
+	if (p->type == TOKEN_WORD && is_name(p->word))
+	{
+		const char *q = p->pos;
+		while (*q == ' ' || *q == '\t')
+			q++;
+		if (*q == '(')
+		{
+			for (q++; *q == ' ' || *q == '\t'; q++)
+				;
+			if (*q == ')')
+			{
+				struct node_t *node = new_node(NODE_FUNCTION);
+				const char *start = p->token_start;
+				node->name = p->word;
+				p->word = NULL;
+				p->pos = q + 1;
+				next_token(p);
+				skip_newlines(p);
+				if (p->type != TOKEN_LPAREN && !token_is_word(p, "{"))
+				{
+					syntax_error(p);
+					return node;
+				}
+				node->child = parse_compound(p);
+				node->text = strndup(start, p->token_start - start);
+				int len = strlen(node->text);
+				while (len > 0 && strchr(" \t\n;", node->text[len - 1]) != NULL)
+					node->text[--len] = 0;
+				return node;
+			}
+		}
+	}
+
+	struct node_t *node = new_node(NODE_COMMAND);
+	struct command_t *command = malloc(sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	command->args = (char **)malloc(sizeof(char *));
+	node->command = command;
+	while (p->status == PARSE_OK)
+	{
+		if (p->type == TOKEN_WORD)
+		{
+			if (command->name == NULL && assignment_name_length(p->word) > 0)
+			{
+				command->assignments = realloc(command->assignments, sizeof(char *) * (command->assignment_count + 1));
+				command->assignments[command->assignment_count++] = p->word;
+			}
+			else if (command->name == NULL)
+				command->name = p->word;
+			else
+			{
+				command->args = (char **)realloc(command->args, sizeof(char *) * (command->arg_count + 1));
+				command->args[command->arg_count++] = p->word;
+			}
+			p->word = NULL;
+			next_token(p);
+		}
+		else if (!parse_redirect(p, command->redirects))
+			break;
+	}
+	if (command->name == NULL)
+	{
+		command->name = strdup("");
+		if (command->redirects[0] == NULL && command->redirects[1] == NULL && command->redirects[2] == NULL && command->assignment_count == 0)
+			syntax_error(p);
+	}
+	return node;
+}
+
+struct node_t *parse_pipeline(struct parser_t *p)
+{
+	bool negate = token_is_word(p, "!");
+	if (negate)
+		next_token(p);
+
+	struct node_t *node = parse_command_node(p);
+	if (p->type == TOKEN_PIPE)
+	{
+		struct node_t *pipeline = new_node(NODE_PIPELINE);
+		add_child(pipeline, node);
+		while (p->status == PARSE_OK && p->type == TOKEN_PIPE)
+		{
+			next_token(p);
+			skip_newlines(p);
+			add_child(pipeline, parse_command_node(p));
+		}
+		node = pipeline;
+	}
+	if (negate)
+	{
+		struct node_t *not = new_node(NODE_NOT);
+		not->child = node;
+		node = not;
+	}
+	return node;
+}
+
+struct node_t *parse_and_or(struct parser_t *p)
+{
+	struct node_t *node = parse_pipeline(p);
+	while (p->status == PARSE_OK && (p->type == TOKEN_AND || p->type == TOKEN_OR))
+	{
+		struct node_t *chain = new_node(p->type == TOKEN_AND ? NODE_AND : NODE_OR);
+		next_token(p);
+		skip_newlines(p);
+		chain->left = node;
+		chain->right = parse_pipeline(p);
+		node = chain;
+	}
+	return node;
+}
+
+/**
+ * Commands separated by ;, & or newlines, up to the end of input or a closing ) or }
+ * @return NODE_LIST, NULL if the list is empty
+ */
+struct node_t *parse_list(struct parser_t *p)
+{
+	struct node_t *list = NULL;
+	skip_newlines(p);
+	while (p->status == PARSE_OK && !at_list_end(p))
+	{
+		struct node_t *node = parse_and_or(p);
+		if (p->type == TOKEN_AMP)
+		{
+			struct node_t *background = new_node(NODE_BACKGROUND);
+			background->child = node;
+			node = background;
+			next_token(p);
+		}
+		else if (p->type == TOKEN_SEMI || p->type == TOKEN_NEWLINE)
+			next_token(p);
+		else if (!at_list_end(p))
+			syntax_error(p);
+		if (list == NULL)
+			list = new_node(NODE_LIST);
+		add_child(list, node);
+		skip_newlines(p);
+	}
+	return list;
+}
+
+void free_node(struct node_t *node)
+{
+	if (node == NULL)
+		return;
+	if (node->command)
+		free_command(node->command);
+	for (int i = 0; i < node->child_count; i++)
+		free_node(node->children[i]);
+	free(node->children);
+	free_node(node->child);
+	free_node(node->left);
+	free_node(node->right);
+	for (int i = 0; i < 3; i++)
+		free(node->redirects[i]);
+	free(node->name);
+	free(node->text);
+	for (int i = 0; i < node->word_count; i++)
+		free(node->words[i]);
+	free(node->words);
+	free(node);
+}
+
+/**
+ * Parse a command string into an AST
+ * @param  buf  [description]
+ * @param  tree set to the parsed list, NULL for an empty line
+ * @return      PARSE_OK, PARSE_INCOMPLETE or PARSE_ERROR
+ */
+int parse_command(const char *buf, struct node_t **tree)
+{
+	struct parser_t p;
+	memset(&p, 0, sizeof(p));
+	p.input = p.pos = buf;
+	next_token(&p);
+	*tree = parse_list(&p);
+	if (p.status == PARSE_OK && p.type != TOKEN_END)
+		syntax_error(&p);
+	free(p.word);
+	for (int i = 0; i < p.heredoc_count; i++)
+		free(p.heredocs[i].delimiter);
+	free(p.heredocs);
+	if (p.status != PARSE_OK)
+	{
+		free_node(*tree);
+		*tree = NULL;
+	}
+	return p.status;
+}
+
+struct command_t *clone_command(const struct command_t *tmpl)
+{
+	struct command_t *command = malloc(sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	command->name = strdup(tmpl->name);
+	command->background = tmpl->background;
+	command->auto_complete = tmpl->auto_complete;
+	command->arg_count = tmpl->arg_count;
+	command->args = malloc(sizeof(char *) * (tmpl->arg_count + 1));
+	for (int i = 0; i < tmpl->arg_count; i++)
+		command->args[i] = strdup(tmpl->args[i]);
+	for (int i = 0; i < 3; i++)
+		if (tmpl->redirects[i])
+			command->redirects[i] = strdup(tmpl->redirects[i]);
+	command->assignment_count = tmpl->assignment_count;
+	command->assignments = malloc(sizeof(char *) * (tmpl->assignment_count + 1));
+	for (int i = 0; i < tmpl->assignment_count; i++)
+		command->assignments[i] = strdup(tmpl->assignments[i]);
+	return command;
+}
+
+struct node_t *clone_node(const struct node_t *node)
+{
+	if (node == NULL)
+		return NULL;
+	struct node_t *copy = new_node(node->type);
+	if (node->command)
+		copy->command = clone_command(node->command);
+	for (int i = 0; i < node->child_count; i++)
+		add_child(copy, clone_node(node->children[i]));
+	copy->child = clone_node(node->child);
+	copy->left = clone_node(node->left);
+	copy->right = clone_node(node->right);
+	for (int i = 0; i < 3; i++)
+		if (node->redirects[i])
+			copy->redirects[i] = strdup(node->redirects[i]);
+	if (node->name)
+		copy->name = strdup(node->name);
+	if (node->text)
+		copy->text = strdup(node->text);
+	if (node->words)
+	{
+		copy->words = malloc(sizeof(char *) * (node->word_count + 1));
+		for (int i = 0; i < node->word_count; i++)
+			copy->words[i] = strdup(node->words[i]);
+		copy->word_count = node->word_count;
+	}
+	return copy;
+}
+
+void prompt_backspace()
+{
+	putchar(8);	  // go back 1
+	putchar(' '); // write empty over
+	putchar(8);	  // go back 1 again
+}
+// a key from the terminal, also handed to the session recording
+int read_key()
+{
+	int c = getchar();
+	if (c != EOF)
+	{
+		char key = c;
+		record_input(&key, 1);
+	}
+	return c;
+}
+/**
+ * Prompt a line from the user
+ * @param  buf          receives the line, 4096 bytes
+ * @param  continuation true when the line continues an unfinished command
+ * @return              EXIT on Ctrl+D or end of input
+ */
+int prompt(char *buf, bool continuation)
+{
+	int index = 0;
+	int c;
+	int walk = history_count; // entry the arrow keys are at, history_count is the line being typed
+
+	// tcgetattr gets the parameters of the current terminal
+	// STDIN_FILENO will tell tcgetattr that it should write the settings
+	// of stdin to oldt
+	static struct termios backup_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &backup_termios);
+	new_termios = backup_termios;
+	// ICANON normally takes care that one line at a time will be processed
+	// that means it will return if it sees a "\n" or an EOF or an EOL
+	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
+	// Those new settings will be set to STDIN
+	// TCSANOW tells tcsetattr to change attributes immediately.
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+	record_track_size();
+	//FIXME: backspace is applied before printing chars
+	if (continuation)
+		printf("> ");
+	else
+		show_prompt();
+	int multicode_state = 0;
+	buf[0] = 0;
+	while (1)
+	{
+		c = read_key();
+		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+		if (c == 9) // handle tab
+		{
+			buf[index++] = '?'; // autocomplete
+			break;
+		}
+
+		if (c == 18 || c == 20) // Ctrl+R searches the history, Ctrl+T bookmarks and shortcuts
+		{
+			char picked[4096];
+			buf[index] = 0;
+			bool ok = fuzzy_select(c == 18 ? FUZZY_HISTORY : FUZZY_MARKS, buf, picked, sizeof(picked));
+			if (continuation)
+				printf("> ");
+			else
+				show_prompt();
+			if (ok)
+			{
+				// the pick runs as if it had been typed
+				snprintf(buf, 4096, "%s", picked);
+				index = strlen(buf);
+				printf("%s\n", buf);
+				break;
+			}
+			printf("%s", buf);
+			continue;
+		}
+
+		if (c == 127) // handle backspace
+		{
+			if (index > 0)
+			{
+				prompt_backspace();
+				index--;
+			}
+			continue;
+		}
+		if (c == 27 && multicode_state == 0) // handle multi-code keys
+		{
+			multicode_state = 1;
+			continue;
+		}
+		if (c == 91 && multicode_state == 1)
+		{
+			multicode_state = 2;
+			continue;
+		}
+		if ((c == 65 || c == 66) && multicode_state == 2) // up and down arrows
+		{
+			multicode_state = 0;
+			if (c == 65 ? walk == 0 : walk >= history_count)
+				continue;
+			walk += c == 65 ? -1 : 1;
+			while (index > 0)
+			{
+				prompt_backspace();
+				index--;
+			}
+			const char *line = walk < history_count ? history_lines[walk] : "";
+			for (index = 0; line[index] && index < 4096 - 1; ++index)
+			{
+				putchar(line[index] == '\n' ? ' ' : line[index]); // a line of several keeps to one on screen
+				buf[index] = line[index];
+			}
+			continue;
+		}
+		else
+			multicode_state = 0;
+
+		putchar(c); // echo the character
+		buf[index++] = c;
+		if (index >= 4096 - 1)
+			break;
+		if (c == '\n') // enter key
+			break;
+		if (c == 4 || c == EOF) // Ctrl+D
+		{
+			tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			return EXIT;
+		}
+	}
+	if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
+		index--;
+	buf[index++] = 0; // null terminate string
+
+	// restore the old settings
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	return SUCCESS;
+}
+int process_command(struct command_t *command);
+
+// Added predefinitions for file_exists and search_path
+int file_exists(const char *file_name);
+char *search_path(const char *file_name);
+
+char *search_short(FILE *fp, const char *alias); // will return the alias token's corresponding file output
+void jump_to(const char *loc, struct command_t *command);
+int shortcut(struct command_t *command);
+
+void bookmark(struct command_t *command);
+void save(FILE *fp, char *argv, int save1);
+void delete (FILE *fp, FILE *fp2, char *target, char *filedir, char *filedir2);
+void library(FILE *fp);
+
+void remindme(struct command_t *command);
+
+int ping_sweep(const char *subnet_command, const char *start_command, const char *end_command);
+int private_dir(struct command_t *command);
+int record_builtin(struct command_t *command);
+int replay_builtin(struct command_t *command);
+int on_change_builtin(struct command_t *command);
+int limit_builtin(struct command_t *command);
+
+int run_command_line(const char *line);
+const char *path_hash_lookup(const char *name);
+void path_hash_insert(const char *name, const char *path);
+void path_hash_reset(const char *path_value);
+int load_rc(bool use_snapshot);
+bool remove_definition(struct definition_t **table, const char *name);
+
+int execute_node(struct node_t *node, bool tail);
+int execute_compound(struct node_t *node, bool tail);
+bool unwinding();
+int loop_builtin(struct command_t *command);
+int return_builtin(struct command_t *command);
+int run_script(const char *path);
+void history_add(const char *line);
+void history_sync();
+int history_builtin(struct command_t *command);
+int fuzzy_builtin(struct command_t *command);
+void frecency_record(const char *dir);
+char *frecency_best(const char *query);
+void init_variables();
+void set_variable(const char *name, const char *value, bool export);
+bool unset_variable(const char *name);
+char **shell_environ();
+char **overlay_environ(char **assignments, int count);
+int export_builtin(struct command_t *command);
+int unset_builtin(struct command_t *command);
+int wait_status(pid_t pid);
+struct redirect_plan;
+void redirect_end(struct redirect_plan *plan);
+
+struct definition_t *find_definition(struct definition_t **table, const char *name);
+struct builtin_t *find_builtin(const char *name);
+void set_definition(struct definition_t **table, const char *name, const char *text, struct node_t *body);
+int run_function(struct definition_t *function, struct command_t *command);
+int alias_builtin(struct command_t *command);
+int unalias_builtin(struct command_t *command);
+
+int main(int argc, char **argv)
+{
+	struct timespec start_time, prompt_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	// Get the first working directory to W
+	getcwd(w, sizeof(w));
+	init_variables();
+
+	bool use_rc = true, use_snapshot = true, startup_bench = false;
+	const char *command_string = NULL, *script = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			command_string = argv[++i];
+		else if (strcmp(argv[i], "--no-rc") == 0)
+			use_rc = false;
+		else if (strcmp(argv[i], "--no-snapshot") == 0)
+			use_snapshot = false;
+		else if (strcmp(argv[i], "--startup-bench") == 0)
+			startup_bench = true;
+		else if (argv[i][0] != '-' && command_string == NULL)
+		{
+			// shellington script args...: the rest of the command line is $1, $2, ...
+			script = argv[i];
+			positional = argv + i + 1;
+			positional_count = argc - i - 1;
+			break;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [-c command | script [args...]] [--no-rc] [--no-snapshot] [--startup-bench]\n", sysname);
+			return UNKNOWN;
+		}
+	}
+
+	if (use_rc && load_rc(use_snapshot) == EXIT)
+		return last_status;
+
+	if (command_string != NULL)
+	{
+		run_command_line(command_string);
+		return last_status;
+	}
+	if (script != NULL)
+	{
+		run_script(script);
+		return last_status;
+	}
+
+	// keys are read one by one, so poll() sees what the prompt has not taken yet
+	setvbuf(stdin, NULL, _IONBF, 0);
+	history_sync(); // what this and the other shells ran before
+
+	if (startup_bench)
+	{
+		// time to first prompt, measured from entering main through the history sync up to where the prompt is drawn
+		clock_gettime(CLOCK_MONOTONIC, &prompt_time);
+		double ms = (prompt_time.tv_sec - start_time.tv_sec) * 1e3 + (prompt_time.tv_nsec - start_time.tv_nsec) / 1e6;
+		fprintf(stderr, "%s: time to first prompt: %.3f ms\n", sysname, ms);
+		return SUCCESS;
+	}
+
+	// lines are collected until they form a complete command, e.g. an unclosed quote or a trailing && continues
+	struct byte_buf input = {0};
+	while (1)
+	{
+		char line[4096];
+		int code;
+
+		while (waitpid(-1, NULL, WNOHANG) > 0) // reap finished background jobs
+			;
+		code = prompt(line, input.len > 0);
+		if (code == EXIT)
+			break;
+
+		buf_append(&input, line, strlen(line));
+		buf_append(&input, "\n", 2);
+		input.len--; // the terminator is overwritten by the next line
+
+		struct node_t *tree;
+		int status = parse_command(input.data, &tree);
+		if (status == PARSE_INCOMPLETE)
+			continue;
+		input.len = 0;
+		history_add(input.data);
+		if (status == PARSE_ERROR)
+		{
+			last_status = 2;
+			continue;
+		}
+
+		code = execute_node(tree, false);
+		free_node(tree);
+		if (code == EXIT)
+			break;
+	}
+	free(input.data);
+
+	printf("\n");
+	return 0;
+}
+
+int process_command(struct command_t *command)
+{
+	int r;
+	bool builtinComm = false;
+
+	if (strcmp(command->name, "") == 0)
+		return SUCCESS;
+
+	// command NAME skips functions and the builtins below, so it reaches the program NAME
+	bool program_only = strcmp(command->name, "command") == 0 && command->arg_count > 0;
+	if (program_only)
+	{
+		free(command->name);
+		command->name = command->args[0];
+		command->arg_count--;
+		memmove(command->args, command->args + 1, sizeof(char *) * command->arg_count);
+	}
+
+	// functions run their parsed body, aliases were already expanded by the executor
+	struct definition_t *function = program_only ? NULL : find_definition(function_table, command->name);
+	if (function != NULL)
+		return run_function(function, command);
+
+	struct builtin_t *builtin = program_only ? NULL : find_builtin(command->name);
+	if (builtin != NULL && !command->background)
+		return builtin->run(command);
+	if (builtin != NULL)
+	{
+		// a background builtin still runs beside the shell
+		fflush(stdout);
+		if (fork() == 0)
+		{
+			builtin->run(command);
+			fflush(stdout);
+			exit(last_status);
+		}
+		last_status = 0;
+		return SUCCESS;
+	}
+
+	if (strcmp(command->name, "break") == 0 || strcmp(command->name, "continue") == 0)
+		return loop_builtin(command);
+	if (strcmp(command->name, "return") == 0)
+		return return_builtin(command);
+	if ((strcmp(command->name, ".") == 0 || strcmp(command->name, "source") == 0) && command->arg_count > 0)
+		return run_script(command->args[0]);
+	if (strcmp(command->name, "fuzzy") == 0)
+		return fuzzy_builtin(command);
+	if (strcmp(command->name, "history") == 0)
+		return history_builtin(command);
+	if (strcmp(command->name, "pmkdir") == 0)
+		return private_dir(command);
+	if (strcmp(command->name, "record") == 0)
+		return record_builtin(command);
+	if (strcmp(command->name, "replay") == 0)
+		return replay_builtin(command);
+	if (strcmp(command->name, "on-change") == 0)
+		return on_change_builtin(command);
+	if (strcmp(command->name, "limit") == 0)
+		return limit_builtin(command);
+	if (strcmp(command->name, "export") == 0)
+		return export_builtin(command);
+	if (strcmp(command->name, "unset") == 0)
+		return unset_builtin(command);
+	if (strcmp(command->name, "alias") == 0)
+		return alias_builtin(command);
+	if (strcmp(command->name, "unalias") == 0)
+		return unalias_builtin(command);
+
+	if (strcmp(command->name, "short") == 0)
+	{
+		// runs in the shell itself, a jump made in a forked child was lost when the child exited
+		last_status = shortcut(command);
+		return SUCCESS;
+	}
+	if (strcmp(command->name, "bookmark") == 0)
+	{
+		builtinComm = true;
+		char *bookmark_comm_set;
 
 		if (strcmp(command->args[0], "-i") != 0 && strcmp(command->args[0], "-l") != 0 && strcmp(command->args[0], "-d") != 0)
 		{
-			// if a conventional command is not set then the command set is merged to a single command
-			bookmark_comm_set = malloc(sizeof(command->args) + 30);
+			// if a conventional command is not set then the command set is merged to a single command
+			int merged_len = 3;
+			for (int i = 0; i < command->arg_count; i++)
+				merged_len += strlen(command->args[i]) + 1;
+			bookmark_comm_set = malloc(merged_len);
+			bookmark_comm_set[0] = 0;
+
+			for (int i = 0; i < command->arg_count; i++)
+			{
+				if (i == 0)
+				{
+					strcat(bookmark_comm_set, "\"");
+				}
+
+				strcat(bookmark_comm_set, command->args[i]);
+				if (i != command->arg_count - 1)
+				{
+					strcat(bookmark_comm_set, " ");
+				}
+			}
+			strcat(bookmark_comm_set, "\"");
+
+			free(command->args[0]);
+			command->args[0] = bookmark_comm_set;
+		}
+		fflush(stdout); // the child must not print what is still buffered here
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			bookmark(command);
+			exit(0);
+		}
+		else
+		{
+			if (!command->background)
+				waitpid(pid, NULL, 0); // wait for child process to finish
+			return SUCCESS;
+		}
+		return SUCCESS;
+	}
+
+	if (strcmp(command->name, "remindme") == 0)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			remindme(command);
+			exit(0);
+		}
+		else
+		{
+			if (!command->background)
+				waitpid(pid, NULL, 0); // wait for child process to finish
+			return SUCCESS;
+		}
+		return SUCCESS;
+	}
+
+	if (strcmp(command->name, "pingsweep") == 0)
+	{
+		builtinComm = true;
+
+		if (command->arg_count != 3)
+		{
+			printf("Usage: pingsweep $subnet $start $end\nIn range (0,254)\n");
+			return SUCCESS;
+		}
+
+		const char *subnet_command = command->args[0];
+		const char *start_command = command->args[1];
+		const char *end_command = command->args[2];
+
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			ping_sweep(subnet_command, start_command, end_command);
+			exit(0);
+		}
+		else
+		{
+			if (!command->background)
+				waitpid(pid, NULL, 0); // wait for child process to finish
+			return SUCCESS;
+		}
+	}
+
+	if (strcmp(command->name, "exit") == 0)
+	{
+		if (command->arg_count > 0)
+			last_status = atoi(command->args[0]);
+		return EXIT;
+	}
+
+	if (strcmp(command->name, "cd") == 0)
+	{
+		const char *dir = command->arg_count > 0 ? command->args[0] : get_variable("HOME");
+		if (dir != NULL)
+		{
+			r = chdir(dir);
+			if (r == -1)
+				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+			else
+			{
+				if (cwd_fd != -1)
+					close(cwd_fd);
+				cwd_fd = -1;
+				char cwd[4096];
+				if (getcwd(cwd, sizeof(cwd)) != NULL)
+				{
+					set_variable("PWD", cwd, false);
+					frecency_record(cwd);
+				}
+			}
+			last_status = r == -1;
+			return SUCCESS;
+		}
+	}
+
+	// the last command of a forked child replaces that child instead of forking again
+	fflush(stdout);
+	pid_t pid = no_fork ? 0 : fork();
+	if (pid == 0) // child
+	{
+		/// The environment is the shell's cached export array, with NAME=value words of this command laid over it
+		char **envp = command->assignment_count ? overlay_environ(command->assignments, command->assignment_count) : shell_environ();
+		// PATH=dir cmd also looks cmd up in dir; only this child sees the change
+		for (int i = 0; i < command->assignment_count; i++)
+			if (strncmp(command->assignments[i], "PATH=", 5) == 0)
+				set_variable("PATH", command->assignments[i] + 5, false);
+
+		/// This shows how to do exec with auto-path resolve
+		// add a NULL argument to the end of args, and the name to the beginning
+		// as required by exec
+
+		// increase args size by 2
+		command->args = (char **)realloc(
+			command->args, sizeof(char *) * (command->arg_count += 2));
+
+		// shift everything forward by 1
+		for (int i = command->arg_count - 2; i > 0; --i)
+			command->args[i] = command->args[i - 1];
+
+		// set args[0] as a copy of name
+		command->args[0] = strdup(command->name);
+		// set args[arg_count-1] (last) to NULL
+		command->args[command->arg_count - 1] = NULL;
+
+		/*
+		execvp(command->name, command->args); // exec+args+path
+		exit(0);
+		No Need for these lines after path resolving implementation
+		*/
+		/// TODO: do your own exec with path resolving using execv()
+
+		/// response to TODO: finds the absolute path of the file for the first input then gets the args for execv().
+		char *file_path = search_path(command->args[0]);
+		if (file_path == NULL && !builtinComm)
+		{
+			printf("-%s: %s: command not found\n", sysname, command->name);
+		}
+		if (file_path != NULL)
+			execve(file_path, command->args, envp);
+		exit(127);
+	}
+	else
+	{
+		if (!command->background)
+			last_status = wait_status(pid); // wait for child process to finish
+		else
+			last_status = 0;
+		return SUCCESS;
+	}
+
+	// TODO: your implementation here
+
+	printf("-%s: %s: command not found\n", sysname, command->name);
+	return UNKNOWN;
+}
+
+// Added code for using execv
+int file_exists(const char *path_name)
+{
+	// opens the path directory to read file path which if exists:
+	// 1. the pointer will not be null
+	// 2. under the condition of one will return true since path to file exists and is valid
+	FILE *fp;
+
+	if ((fp = fopen(path_name, "r")))
+	{
+		fclose(fp);
+		return 1;
+	}
+
+	return 0;
+}
+char *search_path(const char *file_name)
+{
+	// a name with a slash already is a path, relative or absolute
+	if (strchr(file_name, '/') != NULL)
+		return file_exists(file_name) ? strdup(file_name) : NULL;
+
+	// hashed lookups skip the $PATH scan, a hit is only trusted while it is still executable
+	const char *hashed = path_hash_lookup(file_name);
+	if (hashed != NULL && access(hashed, X_OK) == 0)
+		return strdup(hashed);
+
+	// is intended to traverse the existing shell path environment var
+	// $PATH to get the individual file path tokens to scan them all
+	// strtok writes into the string, so it works on a copy instead of the variable itself
+	const char *path_var = get_variable("PATH");
+	char *env = strdup(path_var ? path_var : "");
+	// for the $PATH var the outputs delimiter is ":", for unix based devices
+	const char delim[2] = ":";
+	char *save = NULL;
+	char *paths_env = strtok_r(env, delim, &save);
+
+	while (paths_env != NULL)
+	{
+		// Intention is to search for the path in a manner where $PATH[i]/path
+		// is an existing file meaning that it's the file at question to be executed
+		char *path = malloc(strlen(paths_env) + strlen(file_name) + 2);
+		if (path == NULL)
+		{
+			//in case of a failed malloc
+			return NULL;
+		}
+		strcpy(path, paths_env);
+		strcat(path, "/");
+		strcat(path, file_name);
+
+		if (file_exists(path))
+		{
+			path_hash_insert(file_name, path);
+			free(env);
+			return path;
+		}
+		paths_env = strtok_r(NULL, delim, &save);
+		free(path);
+	}
+	free(env);
+	return NULL;
+}
+
+/// PATH hash: remembers where each command was found so the $PATH scan runs once per name.
+/// The startup snapshot carries a prebuilt copy of the table that is probed in place from the mapping.
+
+struct path_hash_entry
+{
+	char *name;
+	char *path;
+};
+struct path_hash_entry *path_hash = NULL;
+int path_hash_capacity = 0, path_hash_count = 0;
+
+// on-disk layout of the startup snapshot, every *_off field is a byte offset from the start of the file
+struct snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	int64_t rc_mtime_sec, rc_mtime_nsec, rc_size; // rc_size is -1 when there is no rc file
+	uint32_t path_off;		// the inherited PATH, before the rc file ran
+	uint32_t hash_path_off; // the PATH the hash was built from, after the rc file ran
+	uint32_t dir_count;		// directories of that PATH, one mtime pair each at dir_off
+	uint32_t dir_off;
+	uint32_t line_count; // normalized rc command lines, NUL separated at line_off
+	uint32_t line_off;
+	uint32_t slot_count; // open addressed PATH hash, a power of two
+	uint32_t slot_off;
+};
+struct snapshot_slot
+{
+	uint32_t hash;
+	uint32_t name_off; // 0 marks an empty slot
+	uint32_t path_off;
+};
+const struct snapshot_header *snapshot = NULL;
+size_t snapshot_size = 0;
+bool snapshot_hash_current = false; // whether PATH still matches the one the mapped hash was built from
+
+uint32_t hash_string(const char *s)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	while (*s)
+	{
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+const char *path_hash_lookup(const char *name)
+{
+	uint32_t h = hash_string(name);
+	if (path_hash_capacity > 0)
+	{
+		for (int i = h & (path_hash_capacity - 1); path_hash[i].name; i = (i + 1) & (path_hash_capacity - 1))
+			if (strcmp(path_hash[i].name, name) == 0)
+				return path_hash[i].path;
+	}
+	if (snapshot != NULL && snapshot_hash_current && snapshot->slot_count > 0)
+	{
+		const char *base = (const char *)snapshot;
+		const struct snapshot_slot *slots = (const struct snapshot_slot *)(base + snapshot->slot_off);
+		uint32_t mask = snapshot->slot_count - 1;
+		// offsets are checked as they are used, the file ends in a NUL so every string in it is terminated
+		for (uint32_t i = h & mask, probes = 0; slots[i].name_off && probes < snapshot->slot_count; i = (i + 1) & mask, probes++)
+			if (slots[i].hash == h && slots[i].name_off < snapshot_size && slots[i].path_off < snapshot_size && strcmp(base + slots[i].name_off, name) == 0)
+				return base + slots[i].path_off;
+	}
+	return NULL;
+}
+
+// PATH changed: forget every hashed location
+void path_hash_reset(const char *path_value)
+{
+	for (int i = 0; i < path_hash_capacity; i++)
+		if (path_hash[i].name)
+		{
+			free(path_hash[i].name);
+			free(path_hash[i].path);
+			path_hash[i].name = NULL;
+		}
+	path_hash_count = 0;
+	if (snapshot != NULL)
+		snapshot_hash_current = strcmp((const char *)snapshot + snapshot->hash_path_off, path_value) == 0;
+}
+
+void path_hash_insert(const char *name, const char *path)
+{
+	if ((path_hash_count + 1) * 2 > path_hash_capacity)
+	{
+		// grow and rehash, the table is kept at most half full
+		int old_capacity = path_hash_capacity;
+		struct path_hash_entry *old = path_hash;
+		path_hash_capacity = old_capacity ? old_capacity * 2 : 64;
+		path_hash = calloc(path_hash_capacity, sizeof(struct path_hash_entry));
+		path_hash_count = 0;
+		for (int i = 0; i < old_capacity; i++)
+			if (old[i].name)
+			{
+				int j = hash_string(old[i].name) & (path_hash_capacity - 1);
+				while (path_hash[j].name)
+					j = (j + 1) & (path_hash_capacity - 1);
+				path_hash[j] = old[i];
+				path_hash_count++;
+			}
+		free(old);
+	}
+	int i = hash_string(name) & (path_hash_capacity - 1);
+	while (path_hash[i].name && strcmp(path_hash[i].name, name) != 0)
+		i = (i + 1) & (path_hash_capacity - 1);
+	if (path_hash[i].name)
+	{
+		free(path_hash[i].path);
+		path_hash[i].path = strdup(path);
+		return;
+	}
+	path_hash[i].name = strdup(name);
+	path_hash[i].path = strdup(path);
+	path_hash_count++;
+}
+
+/**
+ * Parse and run a command string, used by -c and the rc loader
+ * @param  line [description]
+ * @return      EXIT if the shell should exit
+ */
+int run_command_line(const char *line)
+{
+	struct node_t *tree;
+	int status = parse_command(line, &tree);
+	if (status == PARSE_INCOMPLETE)
+		printf("-%s: syntax error: unexpected end of file\n", sysname);
+	if (status != PARSE_OK)
+	{
+		last_status = 2;
+		return SUCCESS;
+	}
+	int code = execute_node(tree, false);
+	free_node(tree);
+	return code;
+}
+
+/**
+ * Run a script file in this shell; the whole file is parsed before anything runs
+ * @param  path [description]
+ * @return      EXIT if the script ran exit
+ */
+int run_script(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		printf("-%s: %s: %s\n", sysname, path, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		last_status = 127;
+		return SUCCESS;
+	}
+	struct byte_buf text = {0};
+	char chunk[65536];
+	ssize_t n;
+	while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+		buf_append(&text, chunk, n);
+	buf_append(&text, "", 1);
+	close(fd);
+
+	// return at the top level of a sourced script ends the script
+	function_depth++;
+	int code = run_command_line(text.data);
+	function_depth--;
+	pending_return = false;
+	free(text.data);
+	return code;
+}
+
+/**
+ * Read the rc file into normalized commands: comments and blank lines dropped, whitespace trimmed,
+ * and lines joined while they don't form a complete command yet (functions, open quotes)
+ * @param  rc_path [description]
+ * @param  lines   NUL separated commands are appended here
+ * @return         number of commands, -1 if the file can't be read
+ */
+int read_rc_lines(const char *rc_path, struct byte_buf *lines)
+{
+	FILE *fp = fopen(rc_path, "r");
+	if (fp == NULL)
+		return -1;
+
+	int count = 0;
+	char line[4096];
+	struct byte_buf pending = {0};
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char *start = line;
+		int len = strlen(line);
+		while (len > 0 && strchr(" \t\r\n", line[len - 1]) != NULL)
+			line[--len] = 0;
+		while (*start == ' ' || *start == '\t')
+			start++;
+		if (*start == 0 || *start == '#')
+			continue;
+
+		if (pending.len > 0)
+			pending.data[pending.len - 1] = '\n';
+		buf_append(&pending, start, strlen(start) + 1);
+		struct node_t *tree;
+		if (parse_command(pending.data, &tree) == PARSE_INCOMPLETE)
+			continue;
+		free_node(tree);
+		buf_append(lines, pending.data, pending.len);
+		pending.len = 0;
+		count++;
+	}
+	if (pending.len > 0) // unterminated at the end of the file, run_command_line reports it
+	{
+		buf_append(lines, pending.data, pending.len);
+		count++;
+	}
+	free(pending.data);
+	fclose(fp);
+	return count;
+}
+
+// whether len bytes at off lie inside a mapping of size bytes
+bool snapshot_span(size_t size, uint64_t off, uint64_t len)
+{
+	return off <= size && len <= size - off;
+}
+
+/**
+ * Check that every offset and count in a mapped snapshot stays inside it, so a truncated or
+ * damaged file is rebuilt instead of crashing the shell
+ */
+bool snapshot_sane(const struct snapshot_header *h, size_t size)
+{
+	const char *base = (const char *)h;
+	if (base[size - 1] != 0 || h->path_off >= size || h->hash_path_off >= size)
+		return false;
+	if (h->dir_off % 8 != 0 || !snapshot_span(size, h->dir_off, (uint64_t)h->dir_count * 2 * sizeof(int64_t)))
+		return false;
+	if ((h->slot_count & (h->slot_count - 1)) != 0 || h->slot_off % 4 != 0 ||
+		!snapshot_span(size, h->slot_off, (uint64_t)h->slot_count * sizeof(struct snapshot_slot)))
+		return false;
+	// the rc lines are walked one after the other, each has to end before the file does
+	size_t off = h->line_off;
+	for (uint32_t i = 0; i < h->line_count; i++)
+	{
+		const char *end = off < size ? memchr(base + off, 0, size - off) : NULL;
+		if (end == NULL)
+			return false;
+		off = end - base + 1;
+	}
+	return true;
+}
+
+/**
+ * Map the snapshot and check it still describes the rc file and the $PATH directories
+ * @return true if the mapped snapshot can be used
+ */
+bool snapshot_map(const char *snap_path, const struct stat *rc_stat, bool rc_exists, const char *inherited_path)
+{
+	int fd = open(snap_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct snapshot_header))
+	{
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const struct snapshot_header *h = map;
+	const char *base = map;
+	bool valid = memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) == 0 && h->version == SNAPSHOT_VERSION && h->size == st.st_size &&
+				 snapshot_sane(h, st.st_size);
+	if (valid)
+	{
+		if (rc_exists)
+			valid = h->rc_size == rc_stat->st_size && h->rc_mtime_sec == rc_stat->st_mtim.tv_sec && h->rc_mtime_nsec == rc_stat->st_mtim.tv_nsec;
+		else
+			valid = h->rc_size == -1;
+	}
+	if (valid)
+		valid = strcmp(base + h->path_off, inherited_path) == 0;
+	if (valid)
+	{
+		// any PATH directory that changed means commands may have been added or removed
+		const int64_t *mtimes = (const int64_t *)(base + h->dir_off);
+		const char *dir = base + h->hash_path_off;
+		for (uint32_t i = 0; valid && i < h->dir_count; i++)
+		{
+			const char *end = strchr(dir, ':');
+			int len = end ? end - dir : (int)strlen(dir);
+			char dir_path[4096];
+			snprintf(dir_path, sizeof(dir_path), "%.*s", len, dir);
+			struct stat dst;
+			int64_t sec = -1, nsec = -1;
+			if (stat(dir_path, &dst) == 0)
+			{
+				sec = dst.st_mtim.tv_sec;
+				nsec = dst.st_mtim.tv_nsec;
+			}
+			valid = mtimes[2 * i] == sec && mtimes[2 * i + 1] == nsec;
+			dir = end ? end + 1 : dir + len;
+		}
+	}
+	if (!valid)
+	{
+		munmap(map, st.st_size);
+		return false;
+	}
+	if (snapshot != NULL)
+		munmap((void *)snapshot, snapshot_size);
+	snapshot = h;
+	snapshot_size = st.st_size;
+	const char *path_env = get_variable("PATH");
+	snapshot_hash_current = strcmp(base + h->hash_path_off, path_env ? path_env : "") == 0;
+	return true;
+}
+
+/**
+ * Compile the rc lines and a full scan of the $PATH directories into a snapshot file
+ */
+void snapshot_build(const char *snap_path, const struct stat *rc_stat, bool rc_exists, const char *inherited_path, const struct byte_buf *lines, int line_count)
+{
+	struct snapshot_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+	h.version = SNAPSHOT_VERSION;
+	h.rc_size = rc_exists ? rc_stat->st_size : -1;
+	h.rc_mtime_sec = rc_exists ? rc_stat->st_mtim.tv_sec : 0;
+	h.rc_mtime_nsec = rc_exists ? rc_stat->st_mtim.tv_nsec : 0;
+
+	struct byte_buf out = {0}, names = {0};
+	buf_append(&out, &h, sizeof(h));
+
+	const char *path_env = get_variable("PATH");
+	char *path_copy = strdup(path_env ? path_env : "");
+	h.path_off = buf_append(&out, inherited_path, strlen(inherited_path) + 1);
+	h.hash_path_off = buf_append(&out, path_copy, strlen(path_copy) + 1);
+
+	// scan every directory once, earlier PATH entries win like in search_path
+	struct byte_buf dir_mtimes = {0};
+	int name_count = 0;
+	char *save = NULL;
+	for (char *dir = strtok_r(path_copy, ":", &save); dir; dir = strtok_r(NULL, ":", &save))
+	{
+		int64_t mt[2] = {-1, -1};
+		struct stat dst;
+		if (stat(dir, &dst) == 0)
+		{
+			mt[0] = dst.st_mtim.tv_sec;
+			mt[1] = dst.st_mtim.tv_nsec;
+		}
+		buf_append(&dir_mtimes, mt, sizeof(mt));
+		h.dir_count++;
+
+		DIR *d = opendir(dir);
+		if (d == NULL)
+			continue;
+		struct dirent *ent;
+		while ((ent = readdir(d)) != NULL)
+		{
+			if (ent->d_name[0] == '.' || (ent->d_type != DT_REG && ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN))
+				continue;
+			char full[4096];
+			snprintf(full, sizeof(full), "%s/%s", dir, ent->d_name);
+			buf_append(&names, ent->d_name, strlen(ent->d_name) + 1);
+			buf_append(&names, full, strlen(full) + 1);
+			name_count++;
+		}
+		closedir(d);
+	}
+	free(path_copy);
+
+	while (out.len % 8)
+		buf_append(&out, "", 1);
+	h.dir_off = buf_append(&out, dir_mtimes.data, dir_mtimes.len);
+	h.line_count = line_count;
+	h.line_off = buf_append(&out, lines->data ? lines->data : "", lines->len ? lines->len : 1);
+
+	h.slot_count = 16;
+	while (h.slot_count < (uint32_t)name_count * 2)
+		h.slot_count *= 2;
+	struct snapshot_slot *slots = calloc(h.slot_count, sizeof(struct snapshot_slot));
+	const char *p = names.data;
+	for (int n = 0; n < name_count; n++)
+	{
+		const char *name = p, *full = p + strlen(p) + 1;
+		p = full + strlen(full) + 1;
+		uint32_t hash = hash_string(name), i = hash & (h.slot_count - 1);
+		bool seen = false;
+		while (slots[i].name_off && !seen)
+		{
+			seen = slots[i].hash == hash && strcmp(out.data + slots[i].name_off, name) == 0;
+			i = (i + 1) & (h.slot_count - 1);
+		}
+		if (seen)
+			continue;
+		slots[i].hash = hash;
+		slots[i].name_off = buf_append(&out, name, strlen(name) + 1);
+		slots[i].path_off = buf_append(&out, full, strlen(full) + 1);
+	}
+	while (out.len % 8)
+		buf_append(&out, "", 1);
+	h.slot_off = buf_append(&out, slots, h.slot_count * sizeof(struct snapshot_slot));
+	buf_append(&out, "", 1); // ends every string, see snapshot_sane()
+	h.size = out.len;
+	memcpy(out.data, &h, sizeof(h));
+
+	// write next to the target and rename so concurrent shells never map a half written file
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", snap_path, getpid());
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd != -1)
+	{
+		bool ok = write(fd, out.data, out.len) == (ssize_t)out.len;
+		close(fd);
+		if (!ok || rename(tmp_path, snap_path) == -1)
+			unlink(tmp_path);
+	}
+	free(slots);
+	free(names.data);
+	free(dir_mtimes.data);
+	free(out.data);
+}
+
+/**
+ * Run ~/.shellingtonrc, from the snapshot when it is still current
+ * @param  use_snapshot [description]
+ * @return              EXIT if the rc asked the shell to exit
+ */
+int load_rc(bool use_snapshot)
+{
+	const char *home = get_variable("HOME");
+	if (home == NULL)
+		return SUCCESS;
+
+	char rc_path[4096], snap_path[4096];
+	snprintf(rc_path, sizeof(rc_path), "%s/%s", home, RC_FILE);
+	snprintf(snap_path, sizeof(snap_path), "%s/%s", home, SNAPSHOT_FILE);
+
+	struct stat rc_stat;
+	bool rc_exists = stat(rc_path, &rc_stat) == 0;
+
+	// the rc file may change PATH, the snapshot is keyed on the PATH it started from
+	const char *path_env = get_variable("PATH");
+	char *inherited_path = strdup(path_env ? path_env : "");
+
+	int code = SUCCESS;
+	if (use_snapshot && snapshot_map(snap_path, &rc_stat, rc_exists, inherited_path))
+	{
+		const char *line = (const char *)snapshot + snapshot->line_off;
+		for (uint32_t i = 0; i < snapshot->line_count && code != EXIT; i++)
+		{
+			code = run_command_line(line);
+			line += strlen(line) + 1;
+		}
+		free(inherited_path);
+		return code;
+	}
+
+	// every line is replayed in its order, an alias may use a variable or PATH an earlier line set
+	struct byte_buf lines = {0};
+	int line_count = rc_exists ? read_rc_lines(rc_path, &lines) : 0;
+	const char *line = lines.data;
+	for (int i = 0; i < line_count && code != EXIT; i++)
+	{
+		code = run_command_line(line);
+		line += strlen(line) + 1;
+	}
+	if (use_snapshot)
+	{
+		snapshot_build(snap_path, &rc_stat, rc_exists, inherited_path, &lines, line_count < 0 ? 0 : line_count);
+		snapshot_map(snap_path, &rc_stat, rc_exists, inherited_path);
+	}
+	free(inherited_path);
+	free(lines.data);
+	return code;
+}
+
+/// Aliases and shell functions
+
+struct definition_t *find_definition(struct definition_t **table, const char *name)
+{
+	for (struct definition_t *d = table[hash_string(name) % DEFINITION_BUCKETS]; d; d = d->next)
+		if (strcmp(d->name, name) == 0)
+			return d;
+	return NULL;
+}
+
+void free_definition(struct definition_t *d)
+{
+	// a function or alias that redefines or unsets itself is still running, run_function() and
+	// run_alias() free it when they return
+	if (d->depth > 0 || d->expanding)
+	{
+		d->removed = true;
+		return;
+	}
+	free_node(d->body);
+	free(d->name);
+	free(d->text);
+	free(d);
+}
+
+void set_definition(struct definition_t **table, const char *name, const char *text, struct node_t *body)
+{
+	remove_definition(table, name);
+	struct definition_t *d = calloc(1, sizeof(struct definition_t));
+	d->name = strdup(name);
+	d->text = strdup(text);
+	d->body = body;
+	int bucket = hash_string(name) % DEFINITION_BUCKETS;
+	d->next = table[bucket];
+	table[bucket] = d;
+}
+
+bool remove_definition(struct definition_t **table, const char *name)
+{
+	for (struct definition_t **d = &table[hash_string(name) % DEFINITION_BUCKETS]; *d; d = &(*d)->next)
+		if (strcmp((*d)->name, name) == 0)
+		{
+			struct definition_t *found = *d;
+			*d = found->next;
+			free_definition(found);
+			return true;
+		}
+	return false;
+}
+
+void define_alias(const char *name, const char *text)
+{
+	struct node_t *body;
+	if (parse_command(text, &body) != PARSE_OK)
+	{
+		printf("-%s: alias: %s: invalid definition\n", sysname, name);
+		last_status = 1;
+		return;
+	}
+	set_definition(alias_table, name, text, body);
+}
+
+int run_function(struct definition_t *function, struct command_t *command)
+{
+	if (function->depth >= MAX_FUNCTION_DEPTH)
+	{
+		printf("-%s: %s: maximum function nesting level exceeded (%d)\n", sysname, function->name, MAX_FUNCTION_DEPTH);
+		last_status = 1;
+		return SUCCESS;
+	}
+
+	int saved_count = positional_count;
+	char **saved = positional;
+	positional_count = command->arg_count;
+	positional = command->args;
+	function->depth++;
+	function_depth++;
+
+	int code = execute_node(function->body, false);
+	pending_return = false;
+
+	function_depth--;
+	function->depth--;
+	if (function->removed)
+		free_definition(function);
+	positional_count = saved_count;
+	positional = saved;
+	return code;
+}
+
+/// Shell variables
+
+struct variable_t *find_variable(const char *name)
+{
+	for (struct variable_t *v = variable_table[hash_string(name) % VARIABLE_BUCKETS]; v; v = v->next)
+		if (strncmp(v->entry, name, v->name_len) == 0 && name[v->name_len] == 0)
+			return v;
+	return NULL;
+}
+
+const char *get_variable(const char *name)
+{
+	struct variable_t *v = find_variable(name);
+	return v ? v->value : NULL;
+}
+
+/**
+ * Set a variable, creating it if needed
+ * @param export also export it; an exported variable stays exported
+ */
+void set_variable(const char *name, const char *value, bool export)
+{
+	struct variable_t *v = find_variable(name);
+	int name_len = strlen(name);
+	if (v == NULL)
+	{
+		v = calloc(1, sizeof(struct variable_t));
+		v->name_len = name_len;
+		int bucket = hash_string(name) % VARIABLE_BUCKETS;
+		v->next = variable_table[bucket];
+		variable_table[bucket] = v;
+	}
+	else
+		free(v->entry);
+	v->entry = malloc(name_len + strlen(value) + 2);
+	sprintf(v->entry, "%s=%s", name, value);
+	v->value = v->entry + name_len + 1;
+	v->exported |= export;
+	if (v->exported)
+		environ_dirty = true;
+	if (strcmp(name, "PATH") == 0)
+		path_hash_reset(value);
+}
+
+bool unset_variable(const char *name)
+{
+	for (struct variable_t **v = &variable_table[hash_string(name) % VARIABLE_BUCKETS]; *v; v = &(*v)->next)
+		if (strncmp((*v)->entry, name, (*v)->name_len) == 0 && name[(*v)->name_len] == 0)
+		{
+			struct variable_t *found = *v;
+			*v = found->next;
+			if (found->exported)
+				environ_dirty = true;
+			free(found->entry);
+			free(found);
+			if (strcmp(name, "PATH") == 0)
+				path_hash_reset("");
+			return true;
+		}
+	return false;
+}
+
+void init_variables()
+{
+	for (char **e = environ; *e; e++)
+	{
+		char *eq = strchr(*e, '=');
+		if (eq == NULL)
+			continue;
+		char *name = strndup(*e, eq - *e);
+		set_variable(name, eq + 1, true);
+		free(name);
+	}
+}
+
+/**
+ * The environment for execve, rebuilt only when an exported variable changed since the last call
+ * @return NULL terminated "NAME=value" array owned by the shell
+ */
+char **shell_environ()
+{
+	if (!environ_dirty)
+		return environ_cache;
+	int count = 0;
+	for (int i = 0; i < VARIABLE_BUCKETS; i++)
+		for (struct variable_t *v = variable_table[i]; v; v = v->next)
+			count += v->exported;
+	environ_cache = realloc(environ_cache, sizeof(char *) * (count + 1));
+	count = 0;
+	for (int i = 0; i < VARIABLE_BUCKETS; i++)
+		for (struct variable_t *v = variable_table[i]; v; v = v->next)
+			if (v->exported)
+				environ_cache[count++] = v->entry;
+	environ_cache[count] = NULL;
+	environ_dirty = false;
+	// libc's environ keeps the one the shell started with: set_variable() frees entries this array
+	// points at, and threads may be in getenv() at any time, so children are handed this one explicitly
+	return environ_cache;
+}
+
+/**
+ * Lay NAME=value words over the cached environment; only the pointer array is new, the entries are shared
+ * @return NULL terminated array, meant for execve right after fork
+ */
+char **overlay_environ(char **assignments, int count)
+{
+	char **base = shell_environ();
+	int n = 0;
+	while (base[n])
+		n++;
+	char **envp = malloc(sizeof(char *) * (n + count + 1));
+	int k = 0;
+	for (int i = 0; i < count; i++)
+		envp[k++] = assignments[i];
+	for (int i = 0; i < n; i++)
+	{
+		bool overridden = false;
+		for (int j = 0; j < count && !overridden; j++)
+		{
+			int name_len = strchr(assignments[j], '=') - assignments[j];
+			overridden = strncmp(base[i], assignments[j], name_len + 1) == 0;
+		}
+		if (!overridden)
+			envp[k++] = base[i];
+	}
+	envp[k] = NULL;
+	return envp;
+}
+
+// remember the variables an assignment prefix is about to replace, NULL entries were unset
+struct variable_t **save_variables(char **assignments, int count)
+{
+	struct variable_t **saved = calloc(count, sizeof(struct variable_t *));
+	for (int i = 0; i < count; i++)
+	{
+		char *eq = strchr(assignments[i], '=');
+		*eq = 0;
+		struct variable_t *v = find_variable(assignments[i]);
+		if (v != NULL)
+		{
+			saved[i] = malloc(sizeof(struct variable_t));
+			*saved[i] = *v;
+			saved[i]->entry = strdup(v->entry);
+		}
+		*eq = '=';
+	}
+	return saved;
+}
+
+void restore_variables(char **assignments, int count, struct variable_t **saved)
+{
+	for (int i = count - 1; i >= 0; i--)
+	{
+		char *eq = strchr(assignments[i], '=');
+		*eq = 0;
+		if (saved[i] == NULL)
+			unset_variable(assignments[i]);
+		else
+		{
+			set_variable(assignments[i], saved[i]->entry + saved[i]->name_len + 1, false);
+			struct variable_t *v = find_variable(assignments[i]);
+			if (v->exported != saved[i]->exported)
+				environ_dirty = true;
+			v->exported = saved[i]->exported;
+			free(saved[i]->entry);
+			free(saved[i]);
+		}
+		*eq = '=';
+	}
+	free(saved);
+}
+
+int compare_entries(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+int export_builtin(struct command_t *command)
+{
+	last_status = 0;
+	if (command->arg_count == 0 || strcmp(command->args[0], "-p") == 0)
+	{
+		// a copy of the array, sorting the cache itself would be harmless but surprising
+		char **envp = shell_environ();
+		int n = 0;
+		while (envp[n])
+			n++;
+		char **sorted = malloc(sizeof(char *) * (n + 1));
+		memcpy(sorted, envp, sizeof(char *) * n);
+		qsort(sorted, n, sizeof(char *), compare_entries);
+		for (int i = 0; i < n; i++)
+		{
+			char *eq = strchr(sorted[i], '=');
+			printf("export %.*s=\"%s\"\n", (int)(eq - sorted[i]), sorted[i], eq + 1);
+		}
+		free(sorted);
+		return SUCCESS;
+	}
+	for (int i = 0; i < command->arg_count; i++)
+	{
+		char *arg = command->args[i];
+		int name_len = assignment_name_length(arg);
+		if (name_len > 0)
+		{
+			arg[name_len] = 0;
+			set_variable(arg, arg + name_len + 1, true);
+			arg[name_len] = '=';
+		}
+		else if (is_name(arg) && strchr(arg, '-') == NULL)
+		{
+			struct variable_t *v = find_variable(arg);
+			if (v == NULL)
+				set_variable(arg, "", true);
+			else if (!v->exported)
+			{
+				v->exported = true;
+				environ_dirty = true;
+			}
+		}
+		else
+		{
+			printf("-%s: export: '%s': not a valid identifier\n", sysname, arg);
+			last_status = 1;
+		}
+	}
+	return SUCCESS;
+}
+
+int unset_builtin(struct command_t *command)
+{
+	last_status = 0;
+	for (int i = 0; i < command->arg_count; i++)
+	{
+		if (strcmp(command->args[i], "-v") == 0)
+			continue;
+		// unset -f name removes a function
+		if (strcmp(command->args[i], "-f") == 0 && i + 1 < command->arg_count)
+			remove_definition(function_table, command->args[++i]);
+		else
+			unset_variable(command->args[i]);
+	}
+	return SUCCESS;
+}
+
+
+/// Builtins that run inside the shell: they write through stdout's buffer, which the
+/// redirect plan flushes and points at the redirection target, so nothing is forked
+
+/**
+ * Print the backslash escape at *p and move *p past it
+ * @return false for \c, which ends the output
+ */
+bool put_escape(const char **p)
+{
+	const char *s = *p + 1;
+	int c = *s++;
+	switch (c)
+	{
+	case 'a': c = '\a'; break;
+	case 'b': c = '\b'; break;
+	case 'e': c = 033; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'v': c = '\v'; break;
+	case 'c':
+		*p = s - 1;
+		return false;
+	case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7':
+		// \0nnn, and \nnn in a printf format
+		c -= '0';
+		for (int i = 0; i < 3 && *s >= '0' && *s <= '7'; i++)
+			c = c * 8 + *s++ - '0';
+		break;
+	case 0:
+		s--;
+		c = '\\';
+		break;
+	case '\\':
+		break;
+	default:
+		putchar('\\');
+	}
+	putchar(c);
+	*p = s - 1;
+	return true;
+}
+
+int echo_builtin(struct command_t *command)
+{
+	bool newline = true, escapes = false;
+	int i = 0;
+	// -n, -e and -E, also combined like -ne; anything else is printed
+	for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1]; i++)
+	{
+		const char *f = command->args[i] + 1;
+		if (f[strspn(f, "neE")] != 0)
+			break;
+		for (; *f; f++)
+			if (*f == 'n')
+				newline = false;
+			else
+				escapes = *f == 'e';
+	}
+	for (int first = i; i < command->arg_count; i++)
+	{
+		if (i > first)
+			putchar(' ');
+		if (!escapes)
+		{
+			fputs(command->args[i], stdout);
+			continue;
+		}
+		for (const char *p = command->args[i]; *p; p++)
+			if (*p != '\\')
+				putchar(*p);
+			else if (!put_escape(&p))
+			{
+				last_status = 0;
+				return SUCCESS;
+			}
+	}
+	if (newline)
+		putchar('\n');
+	last_status = 0;
+	return SUCCESS;
+}
+
+int pwd_builtin(struct command_t *command)
+{
+	(void)command;
+	char cwd[4096];
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+	{
+		printf("-%s: pwd: %s\n", sysname, strerror(errno));
+		last_status = 1;
+		return SUCCESS;
+	}
+	puts(cwd);
+	last_status = 0;
+	return SUCCESS;
+}
+
+int true_builtin(struct command_t *command)
+{
+	(void)command;
+	last_status = 0;
+	return SUCCESS;
+}
+
+int false_builtin(struct command_t *command)
+{
+	(void)command;
+	last_status = 1;
+	return SUCCESS;
+}
+
+// test operands, evaluated by recursive descent: or := and (-o and)*, and := not (-a not)*
+struct test_state
+{
+	char **args;
+	int pos, end;
+	bool error;
+};
+
+bool test_integer(struct test_state *t, const char *s, long long *n)
+{
+	char *end;
+	errno = 0;
+	*n = strtoll(s, &end, 10);
+	if (*s == 0 || *end != 0 || errno != 0)
+	{
+		printf("-%s: test: %s: integer expression expected\n", sysname, s);
+		t->error = true;
+		return false;
+	}
+	return true;
+}
+
+bool test_binary_operator(const char *op)
+{
+	static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+	for (int i = 0; ops[i]; i++)
+		if (strcmp(op, ops[i]) == 0)
+			return true;
+	return false;
+}
+
+bool test_binary(struct test_state *t, const char *a, const char *op, const char *b)
+{
+	if (op[0] != '-')
+	{
+		int cmp = strcmp(a, b);
+		return op[0] == '<' ? cmp < 0 : op[0] == '>' ? cmp > 0 : op[0] == '!' ? cmp != 0 : cmp == 0;
+	}
+	if ((op[1] == 'n' && op[2] == 't') || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f'))
+	{
+		struct stat sa, sb;
+		bool ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+		if (op[1] == 'e')
+			return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+		if (op[1] == 'o')
+		{
+			const char *s = a;
+			a = b;
+			b = s;
+			struct stat tmp = sa;
+			sa = sb;
+			sb = tmp;
+			bool th = ha;
+			ha = hb;
+			hb = th;
+		}
+		return ha && (!hb || sa.st_mtim.tv_sec > sb.st_mtim.tv_sec || (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec));
+	}
+	long long x, y;
+	if (!test_integer(t, a, &x) || !test_integer(t, b, &y))
+		return false;
+	switch (op[1] * 256 + op[2])
+	{
+	case 'e' * 256 + 'q': return x == y;
+	case 'n' * 256 + 'e': return x != y;
+	case 'l' * 256 + 't': return x < y;
+	case 'l' * 256 + 'e': return x <= y;
+	case 'g' * 256 + 't': return x > y;
+	default: return x >= y;
+	}
+}
+
+bool test_unary(const char *op, const char *arg)
+{
+	struct stat st;
+	switch (op[1])
+	{
+	case 'n': return arg[0] != 0;
+	case 'z': return arg[0] == 0;
+	case 't': return isatty(atoi(arg));
+	case 'r': return access(arg, R_OK) == 0;
+	case 'w': return access(arg, W_OK) == 0;
+	case 'x': return access(arg, X_OK) == 0;
+	case 'h':
+	case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+	}
+	if (stat(arg, &st) != 0)
+		return false;
+	switch (op[1])
+	{
+	case 'f': return S_ISREG(st.st_mode);
+	case 'd': return S_ISDIR(st.st_mode);
+	case 'b': return S_ISBLK(st.st_mode);
+	case 'c': return S_ISCHR(st.st_mode);
+	case 'p': return S_ISFIFO(st.st_mode);
+	case 'S': return S_ISSOCK(st.st_mode);
+	case 's': return st.st_size > 0;
+	case 'u': return st.st_mode & S_ISUID;
+	case 'g': return st.st_mode & S_ISGID;
+	case 'k': return st.st_mode & S_ISVTX;
+	default: return true; // -e
+	}
+}
+
+bool test_or(struct test_state *t);
+
+bool test_primary(struct test_state *t)
+{
+	if (t->pos >= t->end)
+	{
+		printf("-%s: test: argument expected\n", sysname);
+		t->error = true;
+		return false;
+	}
+	char **a = t->args + t->pos;
+	int left = t->end - t->pos;
+	// a binary operator in second place wins, so [ -f = -f ] compares strings
+	if (left >= 3 && test_binary_operator(a[1]))
+	{
+		t->pos += 3;
+		return test_binary(t, a[0], a[1], a[2]);
+	}
+	if (strcmp(a[0], "(") == 0 && left >= 2)
+	{
+		t->pos++;
+		bool r = test_or(t);
+		if (t->pos >= t->end || strcmp(t->args[t->pos], ")") != 0)
+		{
+			printf("-%s: test: ')' expected\n", sysname);
+			t->error = true;
+		}
+		t->pos++;
+		return r;
+	}
+	if (left >= 2 && a[0][0] == '-' && a[0][1] && a[0][2] == 0 && strchr("nztrwxhLfdbcpSsugke", a[0][1]))
+	{
+		t->pos += 2;
+		return test_unary(a[0], a[1]);
+	}
+	t->pos++;
+	return a[0][0] != 0;
+}
+
+bool test_not(struct test_state *t)
+{
+	if (t->pos < t->end - 1 && strcmp(t->args[t->pos], "!") == 0)
+	{
+		t->pos++;
+		return !test_not(t);
+	}
+	return test_primary(t);
+}
+
+bool test_and(struct test_state *t)
+{
+	bool r = test_not(t);
+	while (t->pos < t->end && strcmp(t->args[t->pos], "-a") == 0)
+	{
+		t->pos++;
+		r = test_not(t) && r;
+	}
+	return r;
+}
+
+bool test_or(struct test_state *t)
+{
+	bool r = test_and(t);
+	while (t->pos < t->end && strcmp(t->args[t->pos], "-o") == 0)
+	{
+		t->pos++;
+		r = test_and(t) || r;
+	}
+	return r;
+}
+
+// test and [, status 0 true, 1 false, 2 for a malformed expression
+int test_builtin(struct command_t *command)
+{
+	struct test_state t = {command->args, 0, command->arg_count, false};
+	if (strcmp(command->name, "[") == 0)
+	{
+		if (t.end == 0 || strcmp(command->args[t.end - 1], "]") != 0)
+		{
+			printf("-%s: [: missing ']'\n", sysname);
+			last_status = 2;
+			return SUCCESS;
+		}
+		t.end--;
+	}
+	if (t.end == 0)
+	{
+		last_status = 1;
+		return SUCCESS;
+	}
+	bool r = test_or(&t);
+	if (!t.error && t.pos < t.end)
+	{
+		printf("-%s: test: %s: unexpected operator\n", sysname, t.args[t.pos]);
+		t.error = true;
+	}
+	last_status = t.error ? 2 : !r;
+	return SUCCESS;
+}
+
+int printf_builtin(struct command_t *command)
+{
+	if (command->arg_count == 0)
+	{
+		printf("-%s: printf: usage: printf format [arguments]\n", sysname);
+		last_status = 2;
+		return SUCCESS;
+	}
+	const char *format = command->args[0];
+	int next = 1;
+	last_status = 0;
+	// the format is reused until every argument is consumed
+	do
+	{
+		int first = next;
+		for (const char *p = format; *p; p++)
+		{
+			if (*p == '\\')
+			{
+				if (!put_escape(&p))
+					return SUCCESS;
+				continue;
+			}
+			if (*p != '%')
+			{
+				putchar(*p);
+				continue;
+			}
+			if (p[1] == '%')
+			{
+				putchar(*++p);
+				continue;
+			}
+			// flags, width and precision are handed to printf itself
+			char spec[32] = "%";
+			size_t len = strspn(p + 1, "-+ #0");
+			len += strspn(p + 1 + len, "0123456789");
+			if (p[1 + len] == '.')
+				len += 1 + strspn(p + 2 + len, "0123456789");
+			if (len > sizeof(spec) - 5)
+				len = sizeof(spec) - 5;
+			memcpy(spec + 1, p + 1, len);
+			p += len + 1;
+			const char *arg = next < command->arg_count ? command->args[next++] : NULL;
+			char *end = NULL;
+			switch (*p)
+			{
+			case 's':
+				strcat(spec, "s");
+				printf(spec, arg ? arg : "");
+				break;
+			case 'c':
+				if (arg && *arg)
+					putchar(*arg);
+				break;
+			case 'b':
+				for (const char *b = arg ? arg : ""; *b; b++)
+					if (*b != '\\')
+						putchar(*b);
+					else if (!put_escape(&b))
+						return SUCCESS;
+				break;
+			case 'd':
+			case 'i':
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			{
+				// 'c yields the character code, like the shells do
+				long long n = arg == NULL ? 0 : (arg[0] == '\'' || arg[0] == '"') ? (unsigned char)arg[1] : strtoll(arg, &end, 0);
+				if (end != NULL && (*end != 0 || end == arg))
+				{
+					printf("-%s: printf: %s: invalid number\n", sysname, arg);
+					last_status = 1;
+				}
+				strcat(spec, "ll");
+				strncat(spec, p, 1);
+				printf(spec, n);
+				break;
+			}
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			{
+				double d = arg ? strtod(arg, &end) : 0;
+				if (end != NULL && (*end != 0 || end == arg))
+				{
+					printf("-%s: printf: %s: invalid number\n", sysname, arg);
+					last_status = 1;
+				}
+				strncat(spec, p, 1);
+				printf(spec, d);
+				break;
+			}
+			default:
+				printf("-%s: printf: %%%c: invalid directive\n", sysname, *p ? *p : ' ');
+				last_status = 1;
+				return SUCCESS;
+			}
+		}
+		if (next == first)
+			break;
+	} while (next < command->arg_count);
+	return SUCCESS;
+}
+
+/**
+ * read [-r] [-p prompt] [name ...]: read one line of stdin into variables
+ * stdin is read a byte at a time so nothing past the line is taken from a shared pipe or file
+ */
+int read_builtin(struct command_t *command)
+{
+	bool raw = false;
+	int i = 0;
+	for (; i < command->arg_count && command->args[i][0] == '-'; i++)
+	{
+		if (strcmp(command->args[i], "-r") == 0)
+			raw = true;
+		else if (strcmp(command->args[i], "-p") == 0 && i + 1 < command->arg_count)
+		{
+			fputs(command->args[++i], stdout);
+			fflush(stdout);
+		}
+		else if (strcmp(command->args[i], "--") == 0)
+		{
+			i++;
+			break;
+		}
+		else
+		{
+			printf("-%s: read: %s: invalid option\n", sysname, command->args[i]);
+			last_status = 2;
+			return SUCCESS;
+		}
+	}
+	fflush(stdout);
+
+	struct byte_buf line = {0};
+	char c;
+	ssize_t n;
+	bool got_newline = false;
+	while ((n = read(STDIN_FILENO, &c, 1)) == 1 || (n == -1 && errno == EINTR))
+	{
+		if (n != 1)
+			continue;
+		if (c == '\n')
+		{
+			got_newline = true;
+			break;
+		}
+		if (c == '\\' && !raw)
+		{
+			// a backslash quotes the next character, and joins a line ending in it to the next
+			if (read(STDIN_FILENO, &c, 1) != 1)
+				break;
+			if (c == '\n')
+				continue;
+			buf_append(&line, "\001", 1); // marks a quoted character for the split below
+		}
+		buf_append(&line, &c, 1);
+	}
+	buf_append(&line, "", 1);
+
+	// split on IFS; the last name takes the rest of the line
+	const char *ifs = get_variable("IFS");
+	if (ifs == NULL)
+		ifs = " \t\n";
+	char **names = command->args + i;
+	int name_count = command->arg_count - i;
+	static char *reply[] = {"REPLY"};
+	if (name_count == 0)
+	{
+		names = reply;
+		name_count = 1;
+	}
+	char *p = line.data;
+	struct byte_buf field = {0};
+	for (int k = 0; k < name_count; k++)
+	{
+		field.len = 0;
+		while (*p && strchr(ifs, *p) && strchr(" \t\n", *p))
+			p++;
+		size_t kept = 0; // the field without trailing IFS whitespace
+		while (*p)
+		{
+			bool quoted = *p == '\001';
+			if (quoted)
+				p++;
+			else if (k < name_count - 1 && strchr(ifs, *p))
+			{
+				p++;
+				break;
+			}
+			buf_append(&field, p, 1);
+			if (quoted || !strchr(ifs, *p) || !strchr(" \t\n", *p))
+				kept = field.len;
+			p++;
+		}
+		field.len = kept;
+		buf_append(&field, "", 1);
+		set_variable(names[k], field.data, false);
+	}
+	free(field.data);
+	free(line.data);
+	last_status = !got_newline; // end of file, even after a partial line
+	return SUCCESS;
+}
+
+// builtins that also exist as programs, so `command name` can still reach the program
+struct builtin_t fast_builtins[] = {
+	{"echo", echo_builtin},
+	{"pwd", pwd_builtin},
+	{"test", test_builtin},
+	{"[", test_builtin},
+	{"printf", printf_builtin},
+	{"true", true_builtin},
+	{":", true_builtin},
+	{"false", false_builtin},
+	{"read", read_builtin},
+	{NULL, NULL}};
+
+struct builtin_t *find_builtin(const char *name)
+{
+	for (struct builtin_t *b = fast_builtins; b->name; b++)
+		if (strcmp(name, b->name) == 0)
+			return b;
+	return NULL;
+}
+
+// names process_command() handles without launching a program
+bool is_shell_builtin(const char *name)
+{
+	static const char *builtins[] = {"cd", "exit", "export", "unset", "alias", "unalias", "break", "continue", "return", ".", "source", "fuzzy", "history", "short", "bookmark", "remindme", "pingsweep", "pmkdir", "record", "replay", "on-change", "limit", NULL};
+	for (int i = 0; builtins[i]; i++)
+		if (strcmp(name, builtins[i]) == 0)
+			return true;
+	return find_builtin(name) != NULL;
+}
+
+/// Expansion: turns the raw words of a parsed command into the argv handed to process_command()
+
+struct word_list
+{
+	char **words;
+	int count;
+};
+
+void expand_word(const char *raw, struct word_list *out, bool split);
+
+void word_list_add(struct word_list *list, char *word)
+{
+	list->words = realloc(list->words, sizeof(char *) * (list->count + 2));
+	list->words[list->count++] = word;
+	list->words[list->count] = NULL;
+}
+
+/**
+ * Look up the parameter referenced after a $
+ * @param  p     points at the character after the $
+ * @param  end   set past the reference
+ * @param  value set to a newly allocated value, NULL if the parameter is unset
+ * @return       false if the $ does not start a parameter and stays literal
+ */
+bool lookup_parameter(const char *p, const char **end, char **value)
+{
+	char number[32];
+	bool braced = *p == '{';
+	bool length = braced && p[1] == '#' && p[2] != '}'; // ${#name}
+	const char *name = braced ? p + 1 + length : p;
+	const char *name_end = name;
+	if (*name >= '0' && *name <= '9')
+		name_end = braced ? name + strspn(name, "0123456789") : name + 1;
+	else if (*name && strchr("@*#?$", *name))
+		name_end = name + 1;
+	else
+		while (*name_end == '_' || (*name_end >= 'a' && *name_end <= 'z') || (*name_end >= 'A' && *name_end <= 'Z') || (name_end > name && *name_end >= '0' && *name_end <= '9'))
+			name_end++;
+	if (name_end == name)
+		return false;
+
+	// ${name:-word} ${name-word} ${name:=word} ${name:+word}
+	const char *op = NULL, *word = NULL, *close = name_end;
+	if (braced)
+	{
+		if (*name_end == ':' || (*name_end && strchr("-=+", *name_end)))
+		{
+			op = name_end;
+			word = op + (*op == ':' ? 2 : 1);
+			if (*op == ':' && (op[1] == 0 || strchr("-=+", op[1]) == NULL))
+				return false;
+			// the word runs to the matching brace
+			int depth = 1;
+			for (close = word; *close && depth; close++)
+			{
+				if (*close == '\\' && close[1])
+					close++;
+				else if (*close == '{')
+					depth++;
+				else if (*close == '}')
+					depth--;
+			}
+			close--;
+		}
+		if (*close != '}')
+			return false;
+		*end = close + 1;
+	}
+	else
+		*end = name_end;
+
+	*value = NULL;
+	char *name_copy = strndup(name, name_end - name);
+	if (*name >= '0' && *name <= '9')
+	{
+		int n = atoi(name);
+		if (n == 0)
+			*value = strdup(sysname);
+		else if (n <= positional_count)
+			*value = strdup(positional[n - 1]);
+	}
+	else if (*name == '@' || *name == '*')
+	{
+		struct byte_buf joined = {0};
+		for (int i = 0; i < positional_count; i++)
+		{
+			if (i > 0)
+				buf_append(&joined, " ", 1);
+			buf_append(&joined, positional[i], strlen(positional[i]));
+		}
+		buf_append(&joined, "", 1);
+		*value = joined.data;
+	}
+	else if (strchr("#?$", *name))
+	{
+		snprintf(number, sizeof(number), "%d", *name == '#' ? positional_count : *name == '?' ? last_status : (int)getpid());
+		*value = strdup(number);
+	}
+	else
+	{
+		const char *v = get_variable(name_copy);
+		if (v != NULL)
+			*value = strdup(v);
+	}
+
+	if (op != NULL)
+	{
+		bool use_word, colon = *op == ':';
+		char sign = colon ? op[1] : op[0];
+		bool set = *value != NULL && (!colon || **value != 0);
+		use_word = sign == '+' ? set : !set;
+		if (use_word)
+		{
+			char *raw = strndup(word, close - word);
+			struct word_list expanded = {0};
+			expand_word(raw, &expanded, false);
+			free(*value);
+			*value = expanded.count ? expanded.words[0] : strdup("");
+			free(expanded.words);
+			free(raw);
+			if (sign == '=' && *name != '@' && !(*name >= '0' && *name <= '9') && strchr("*#?$", *name) == NULL)
+				set_variable(name_copy, *value, false);
+		}
+		else if (sign == '+')
+		{
+			free(*value);
+			*value = NULL;
+		}
+	}
+	if (length)
+	{
+		snprintf(number, sizeof(number), "%zu", *value ? strlen(*value) : 0);
+		free(*value);
+		*value = strdup(number);
+	}
+	free(name_copy);
+	return true;
+}
+
+// fds and producers of <( ) and >( ) for the command being built, released once it has run
+#define MAX_SUBSTITUTIONS 16
+int substitution_fds[MAX_SUBSTITUTIONS];
+int substitution_count = 0;
+
+/**
+ * Run a command string in a child whose stdout is a pipe and collect everything it writes
+ * @param  text command text between $( ) or backquotes
+ * @return      newly allocated output with trailing newlines removed
+ */
+char *command_substitution(const char *text)
+{
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC) == -1)
+	{
+		printf("-%s: pipe: %s\n", sysname, strerror(errno));
+		return strdup("");
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		dup2(fds[1], STDOUT_FILENO);
+		struct node_t *tree;
+		if (parse_command(text, &tree) == PARSE_OK)
+			execute_node(tree, true);
+		fflush(stdout);
+		exit(last_status);
+	}
+	close(fds[1]);
+
+	// fast path: output that fits in one pipe buffer is read into the stack and copied out once
+	char small[65536];
+	size_t len = 0;
+	ssize_t n;
+	while (len < sizeof(small) && ((n = read(fds[0], small + len, sizeof(small) - len)) > 0 || (n == -1 && errno == EINTR)))
+		if (n > 0)
+			len += n;
+
+	char *out;
+	if (len < sizeof(small))
+	{
+		out = malloc(len + 1);
+		memcpy(out, small, len);
+	}
+	else
+	{
+		// larger output keeps reading straight into a heap buffer that doubles whenever it fills up
+		size_t cap = sizeof(small) * 4;
+		out = malloc(cap);
+		memcpy(out, small, len);
+		while (1)
+		{
+			if (cap - len < sizeof(small))
+				out = realloc(out, cap *= 2);
+			n = read(fds[0], out + len, cap - len - 1);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			len += n;
+		}
+	}
+	close(fds[0]);
+	last_status = wait_status(pid);
+
+	while (len > 0 && out[len - 1] == '\n')
+		len--;
+	out[len] = 0;
+	return out;
+}
+
+/**
+ * Start the command of a <( ) or >( ) on a pipe
+ * @param  text  command text
+ * @param  input true for <( ), where the command writes and the shell hands out the read end
+ * @return       newly allocated /dev/fd/N path for the shell's end of the pipe
+ */
+char *process_substitution(const char *text, bool input)
+{
+	int fds[2];
+	if (substitution_count >= MAX_SUBSTITUTIONS || pipe(fds) == -1)
+	{
+		printf("-%s: too many process substitutions\n", sysname);
+		return strdup("/dev/null");
+	}
+	int keep = input ? fds[0] : fds[1], give = input ? fds[1] : fds[0];
+	fflush(stdout);
+	if (fork() == 0)
+	{
+		dup2(give, input ? STDOUT_FILENO : STDIN_FILENO);
+		close(give);
+		close(keep);
+		struct node_t *tree;
+		if (parse_command(text, &tree) == PARSE_OK)
+			execute_node(tree, true);
+		fflush(stdout);
+		exit(last_status);
+	}
+	// the kept end is inherited by the command, it is closed after the command ran
+	close(give);
+	substitution_fds[substitution_count++] = keep;
+	char path[32];
+	snprintf(path, sizeof(path), "/dev/fd/%d", keep);
+	return strdup(path);
+}
+
+void release_substitutions()
+{
+	for (int i = 0; i < substitution_count; i++)
+		close(substitution_fds[i]);
+	substitution_count = 0;
+}
+
+/**
+ * Append an expansion result to the field being built
+ * @param quoted unquoted results are split at blanks into separate fields
+ */
+void append_expansion(struct byte_buf *field, bool *have_field, const char *value, bool quoted, struct word_list *out)
+{
+	if (quoted)
+	{
+		buf_append(field, value, strlen(value));
+		return;
+	}
+	for (const char *v = value; *v; v++)
+	{
+		if (*v == ' ' || *v == '\t' || *v == '\n')
+		{
+			if (*have_field)
+			{
+				buf_append(field, "", 1);
+				word_list_add(out, field->data);
+				memset(field, 0, sizeof(*field));
+				*have_field = false;
+			}
+			continue;
+		}
+		buf_append(field, v, 1);
+		*have_field = true;
+	}
+}
+
+bool expansion_failed = false; // set by an expansion error, the command is not run
+
+/// Arithmetic: $(( )) is evaluated with C long long semantics after its parameters are expanded
+
+struct arith_state
+{
+	const char *p;
+	bool error;
+	int skip; // inside the branch of && || ?: that is not taken: no assignments, no division errors
+};
+
+long long arith_assign(struct arith_state *a);
+
+void arith_space(struct arith_state *a)
+{
+	while (*a->p == ' ' || *a->p == '\t' || *a->p == '\n')
+		a->p++;
+}
+
+void arith_error(struct arith_state *a, const char *message)
+{
+	if (!a->error)
+		printf("-%s: arithmetic: %s (error token is \"%s\")\n", sysname, message, a->p);
+	a->error = true;
+}
+
+long long arith_variable(const char *name)
+{
+	const char *value = get_variable(name);
+	if (value == NULL || *value == 0)
+		return 0;
+	return strtoll(value, NULL, 0);
+}
+
+void arith_store(struct arith_state *a, const char *name, long long n)
+{
+	if (a->skip)
+		return;
+	char number[32];
+	snprintf(number, sizeof(number), "%lld", n);
+	set_variable(name, number, false);
+}
+
+// numbers, names with ++ and --, and parentheses
+long long arith_primary(struct arith_state *a)
+{
+	arith_space(a);
+	if (*a->p == '(')
+	{
+		a->p++;
+		long long n = arith_assign(a);
+		arith_space(a);
+		if (*a->p != ')')
+			arith_error(a, "missing ')'");
+		else
+			a->p++;
+		return n;
+	}
+	if (*a->p >= '0' && *a->p <= '9')
+	{
+		// parsed unsigned so 9223372036854775808 wraps like in bash and "name op= value" can
+		// hand arith_binary() a left side of LLONG_MIN
+		char *end;
+		long long n = (long long)strtoull(a->p, &end, 0);
+		a->p = end;
+		return n;
+	}
+	const char *start = a->p;
+	while (*a->p == '_' || (*a->p >= 'a' && *a->p <= 'z') || (*a->p >= 'A' && *a->p <= 'Z') || (a->p > start && *a->p >= '0' && *a->p <= '9'))
+		a->p++;
+	if (a->p == start)
+	{
+		arith_error(a, "operand expected");
+		return 0;
+	}
+	char *name = strndup(start, a->p - start);
+	long long n = arith_variable(name);
+	arith_space(a);
+	if ((a->p[0] == '+' || a->p[0] == '-') && a->p[1] == a->p[0])
+	{
+		arith_store(a, name, a->p[0] == '+' ? n + 1 : n - 1);
+		a->p += 2;
+	}
+	free(name);
+	return n;
+}
+
+long long arith_unary(struct arith_state *a)
+{
+	arith_space(a);
+	char c = *a->p;
+	if ((c == '+' || c == '-') && a->p[1] == c)
+	{
+		// ++name and --name
+		a->p += 2;
+		arith_space(a);
+		const char *start = a->p;
+		arith_primary(a);
+		char *name = strndup(start, a->p - start);
+		name[strcspn(name, " \t\n")] = 0;
+		long long n = arith_variable(name) + (c == '+' ? 1 : -1);
+		arith_store(a, name, n);
+		free(name);
+		return n;
+	}
+	if (c == '+' || c == '-' || c == '!' || c == '~')
+	{
+		a->p++;
+		long long n = arith_unary(a);
+		return c == '-' ? (long long)-(unsigned long long)n : c == '!' ? !n : c == '~' ? ~n : n;
+	}
+	return arith_primary(a);
+}
+
+// binary operators from loosest to tightest binding
+static const struct
+{
+	const char *op;
+	int precedence;
+} arith_operators[] = {
+	{"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5}, {"==", 6}, {"!=", 6},
+	{"<=", 7}, {">=", 7}, {"<<", 8}, {">>", 8}, {"<", 7}, {">", 7},
+	{"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10}, {NULL, 0}};
+
+long long arith_binary(struct arith_state *a, int min_precedence)
+{
+	long long left = arith_unary(a);
+	while (!a->error)
+	{
+		arith_space(a);
+		int i = 0;
+		for (; arith_operators[i].op; i++)
+			if (strncmp(a->p, arith_operators[i].op, strlen(arith_operators[i].op)) == 0)
+				break;
+		const char *op = arith_operators[i].op;
+		// an assignment like += belongs to arith_assign, and a single | or & must not eat || or &&
+		if (op == NULL || arith_operators[i].precedence < min_precedence || (a->p[strlen(op)] == '=' && op[1] != '='))
+			break;
+		a->p += strlen(op);
+		bool short_circuit = (op[1] == '&' && !left) || (op[1] == '|' && left);
+		a->skip += short_circuit;
+		long long right = arith_binary(a, arith_operators[i].precedence + 1);
+		a->skip -= short_circuit;
+		if ((op[0] == '/' || op[0] == '%') && right == 0)
+		{
+			if (!a->skip)
+				arith_error(a, "division by 0");
+			right = 1;
+		}
+		// the one quotient that does not fit traps on x86, dividing by 1 gives bash's wrapped
+		// LLONG_MIN and remainder 0
+		if ((op[0] == '/' || op[0] == '%') && right == -1 && left == LLONG_MIN)
+			right = 1;
+		// shift counts wrap like bash does, and the arithmetic below is done unsigned so an
+		// overflow wraps around instead of being undefined
+		if ((op[0] == '<' || op[0] == '>') && op[1] == op[0])
+			right &= 63;
+		switch (op[0] * 256 + op[1])
+		{
+		case '|' * 256 + '|': left = left || right; break;
+		case '&' * 256 + '&': left = left && right; break;
+		case '|' * 256: left |= right; break;
+		case '^' * 256: left ^= right; break;
+		case '&' * 256: left &= right; break;
+		case '=' * 256 + '=': left = left == right; break;
+		case '!' * 256 + '=': left = left != right; break;
+		case '<' * 256 + '=': left = left <= right; break;
+		case '>' * 256 + '=': left = left >= right; break;
+		case '<' * 256 + '<': left = (long long)((unsigned long long)left << right); break;
+		case '>' * 256 + '>': left >>= right; break;
+		case '<' * 256: left = left < right; break;
+		case '>' * 256: left = left > right; break;
+		case '+' * 256: left = (long long)((unsigned long long)left + (unsigned long long)right); break;
+		case '-' * 256: left = (long long)((unsigned long long)left - (unsigned long long)right); break;
+		case '*' * 256: left = (long long)((unsigned long long)left * (unsigned long long)right); break;
+		case '/' * 256: left /= right; break;
+		default: left %= right;
+		}
+	}
+	return left;
+}
+
+// name = expr, name op= expr, and cond ? expr : expr
+long long arith_assign(struct arith_state *a)
+{
+	arith_space(a);
+	const char *start = a->p;
+	const char *q = start;
+	while (*q == '_' || (*q >= 'a' && *q <= 'z') || (*q >= 'A' && *q <= 'Z') || (q > start && *q >= '0' && *q <= '9'))
+		q++;
+	const char *name_end = q;
+	while (*q == ' ' || *q == '\t')
+		q++;
+	size_t op_len = strspn(q, "+-*/%<>&|^");
+	if (name_end > start && q[op_len] == '=' && q[op_len + 1] != '=' && (op_len == 0 || op_len == 1 || (op_len == 2 && q[0] == q[1] && (q[0] == '<' || q[0] == '>'))))
+	{
+		char *name = strndup(start, name_end - start);
+		a->p = q + op_len + 1;
+		long long value = arith_assign(a);
+		if (op_len > 0)
+		{
+			// name op= value is name = name op value
+			char text[64];
+			snprintf(text, sizeof(text), "%lld%.*s(%lld)", arith_variable(name), (int)op_len, q, value);
+			struct arith_state inner = {text, false, a->skip};
+			value = arith_binary(&inner, 1);
+			a->error |= inner.error;
+		}
+		arith_store(a, name, value);
+		free(name);
+		return value;
+	}
+
+	long long n = arith_binary(a, 1);
+	arith_space(a);
+	if (*a->p != '?')
+		return n;
+	a->p++;
+	a->skip += !n;
+	long long yes = arith_assign(a);
+	a->skip -= !n;
+	arith_space(a);
+	if (*a->p != ':')
+	{
+		arith_error(a, "':' expected");
+		return 0;
+	}
+	a->p++;
+	a->skip += !!n;
+	long long no = arith_assign(a);
+	a->skip -= !!n;
+	return n ? yes : no;
+}
+
+/**
+ * Evaluate the text between $(( and ))
+ * @return newly allocated decimal result, "0" after an error
+ */
+char *arithmetic_expansion(const char *text)
+{
+	struct word_list expanded = {0};
+	expand_word(text, &expanded, false);
+	struct arith_state a = {expanded.words[0], false, 0};
+	long long n = arith_assign(&a);
+	while (!a.error && *a.p == ',')
+	{
+		a.p++;
+		n = arith_assign(&a);
+	}
+	arith_space(&a);
+	if (*a.p != 0)
+		arith_error(&a, "syntax error in expression");
+	if (a.error)
+	{
+		expansion_failed = true;
+		n = 0;
+	}
+	free(expanded.words[0]);
+	free(expanded.words);
+	char number[32];
+	snprintf(number, sizeof(number), "%lld", n);
+	return strdup(number);
+}
+
+/**
+ * Expand a raw word into zero or more fields: tilde, parameters and command substitutions,
+ * then field splitting of unquoted results, then quote removal
+ * @param raw     [description]
+ * @param out     fields are appended here
+ * @param split   false for assignment values, which always expand to exactly one field
+ * @param heredoc raw is a heredoc body: expanded as if in double quotes, but quotes are plain text
+ */
+void expand_text(const char *raw, struct word_list *out, bool split, bool heredoc)
+{
+	// "$@" keeps every positional parameter a separate field, and no field at all when there are none
+	if (strcmp(raw, "\"$@\"") == 0)
+	{
+		for (int i = 0; i < positional_count; i++)
+			word_list_add(out, strdup(positional[i]));
+		return;
+	}
+
+	struct byte_buf field = {0};
+	bool have_field = !split; // a quoted empty string still produces a field
+	bool in_double = heredoc;
+	if (!heredoc && raw[0] == '~' && (raw[1] == 0 || raw[1] == '/'))
+	{
+		const char *home = get_variable("HOME");
+		buf_append(&field, home ? home : "~", strlen(home ? home : "~"));
+		have_field = true;
+		raw++;
+	}
+	for (const char *p = raw; *p; p++)
+	{
+		const char *end;
+		char *value;
+		if (!in_double && *p == '\'')
+		{
+			end = strchr(p + 1, '\'');
+			buf_append(&field, p + 1, end - p - 1);
+			have_field = true;
+			p = end;
+		}
+		else if (*p == '"' && !heredoc)
+		{
+			in_double = !in_double;
+			have_field = true;
+		}
+		else if (*p == '\\' && p[1])
+		{
+			// inside double quotes a backslash only escapes $ ` " \ and newline, in a heredoc not even "
+			if (in_double && strchr(heredoc ? "$`\\\n" : "$`\"\\\n", p[1]) == NULL)
+				buf_append(&field, p, 1);
+			p++;
+			if (*p != '\n')
+				buf_append(&field, p, 1);
+			have_field = true;
+		}
+		else if (*p == '$' && p[1] == '(' && p[2] == '(' && (end = skip_parens(p + 1)) != NULL && end[-2] == ')')
+		{
+			char *text = strndup(p + 3, end - p - 5);
+			value = arithmetic_expansion(text);
+			append_expansion(&field, &have_field, value, in_double || !split, out);
+			free(text);
+			free(value);
+			p = end - 1;
+		}
+		else if (*p == '$' && p[1] == '(' && (end = skip_parens(p + 1)) != NULL)
+		{
+			char *text = strndup(p + 2, end - p - 3);
+			value = command_substitution(text);
+			append_expansion(&field, &have_field, value, in_double || !split, out);
+			free(text);
+			free(value);
+			p = end - 1;
+		}
+		else if (*p == '`' && (end = skip_backquote(p)) != NULL)
+		{
+			// inside backquotes \` \\ and \$ stand for the plain character
+			struct byte_buf text = {0};
+			for (const char *q = p + 1; q < end - 1; q++)
+			{
+				if (*q == '\\' && strchr("`\\$", q[1]) != NULL)
+					q++;
+				buf_append(&text, q, 1);
+			}
+			buf_append(&text, "", 1);
+			value = command_substitution(text.data);
+			append_expansion(&field, &have_field, value, in_double || !split, out);
+			free(text.data);
+			free(value);
+			p = end - 1;
+		}
+		else if (!in_double && (*p == '<' || *p == '>') && p[1] == '(' && (end = skip_parens(p + 1)) != NULL)
+		{
+			char *text = strndup(p + 2, end - p - 3);
+			value = process_substitution(text, *p == '<');
+			buf_append(&field, value, strlen(value));
+			have_field = true;
+			free(text);
+			free(value);
+			p = end - 1;
+		}
+		else if (*p == '$' && lookup_parameter(p + 1, &end, &value))
+		{
+			if (value != NULL)
+				append_expansion(&field, &have_field, value, in_double || !split, out);
+			free(value);
+			p = end - 1;
+		}
+		else
+		{
+			// a heredoc body is mostly plain text, taken a run at a time
+			size_t run = heredoc ? 1 + strcspn(p + 1, "$`\\") : 1;
+			buf_append(&field, p, run);
+			have_field = true;
+			p += run - 1;
+		}
+	}
+	if (have_field)
+	{
+		buf_append(&field, "", 1);
+		word_list_add(out, field.data);
+	}
+	else
+		free(field.data);
+}
+
+void expand_word(const char *raw, struct word_list *out, bool split)
+{
+	expand_text(raw, out, split, false);
+}
+
+/**
+ * Build the command that process_command() runs from a parsed template
+ * @param  tmpl [description]
+ * @return      NULL if a redirection target does not expand to a single word
+ */
+struct command_t *expand_command(const struct command_t *tmpl)
+{
+	struct word_list words = {0};
+	expansion_failed = false;
+	expand_word(tmpl->name, &words, true);
+	for (int i = 0; i < tmpl->arg_count; i++)
+		expand_word(tmpl->args[i], &words, true);
+
+	struct command_t *command = malloc(sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	command->background = tmpl->background;
+	command->auto_complete = tmpl->auto_complete;
+	command->name = words.count > 0 ? words.words[0] : strdup("");
+	command->arg_count = words.count > 0 ? words.count - 1 : 0;
+	command->args = malloc(sizeof(char *) * (command->arg_count + 1));
+	for (int i = 0; i < command->arg_count; i++)
+		command->args[i] = words.words[i + 1];
+	free(words.words);
+
+	for (int i = 0; i < 3; i++)
+	{
+		if (tmpl->redirects[i] == NULL)
+			continue;
+		if (is_heredoc(tmpl->redirects[i]))
+		{
+			// expanded by redirect_begin(), which also sees the unexpanded redirections of compound commands
+			command->redirects[i] = strdup(tmpl->redirects[i]);
+			continue;
+		}
+		struct word_list target = {0};
+		expand_word(tmpl->redirects[i], &target, true);
+		if (target.count != 1)
+		{
+			printf("-%s: %s: ambiguous redirect\n", sysname, tmpl->redirects[i]);
+			for (int j = 0; j < target.count; j++)
+				free(target.words[j]);
+			free(target.words);
+			free_command(command);
+			return NULL;
+		}
+		command->redirects[i] = target.words[0];
+		free(target.words);
+	}
+
+	// NAME=value words keep their form, only the value is expanded
+	command->assignments = malloc(sizeof(char *) * (tmpl->assignment_count + 1));
+	for (int i = 0; i < tmpl->assignment_count; i++)
+	{
+		int name_len = assignment_name_length(tmpl->assignments[i]);
+		struct word_list value = {0};
+		expand_word(tmpl->assignments[i] + name_len + 1, &value, false);
+		char *assignment = malloc(name_len + strlen(value.words[0]) + 2);
+		sprintf(assignment, "%.*s=%s", name_len, tmpl->assignments[i], value.words[0]);
+		command->assignments[command->assignment_count++] = assignment;
+		free(value.words[0]);
+		free(value.words);
+	}
+	if (expansion_failed)
+	{
+		// like a bad redirect, a failed $(( )) cancels the command
+		free_command(command);
+		return NULL;
+	}
+	return command;
+}
+
+/// Executor: walks the AST, forking only for external commands, pipelines, subshells and background jobs
+
+// file descriptors a redirection replaced, restored when the command is done
+struct redirect_plan
+{
+	int saved[2];
+};
+
+#define HEREDOC_PIPE_MAX 65536 // bodies up to the default pipe buffer go through a pipe
+
+bool write_all(int fd, const void *data, size_t len);
+
+/**
+ * Expand a heredoc or here-string and hand back something to read it from. A body that fits
+ * in a pipe is written into one, nobody has to read it first; a bigger one goes into a memfd
+ * sealed against writes, so it never touches the disk and the command can't change it
+ * @param  redirect redirects[0], starting with HEREDOC_LITERAL, HEREDOC_EXPAND or HERESTRING
+ * @return          descriptor at the start of the body, -1 after an error
+ */
+int heredoc_open(const char *redirect)
+{
+	char *body;
+	size_t len;
+	expansion_failed = false;
+	if (redirect[0] == HEREDOC_LITERAL || (redirect[0] == HEREDOC_EXPAND && strpbrk(redirect + 1, "$`\\") == NULL))
+	{
+		body = (char *)redirect + 1;
+		len = strlen(body);
+	}
+	else
+	{
+		struct word_list expanded = {0};
+		expand_text(redirect + 1, &expanded, false, redirect[0] == HEREDOC_EXPAND);
+		// <<< "$@" gives one field per parameter, joined like "$*"
+		struct byte_buf text = {0};
+		for (int i = 0; i < expanded.count; i++)
+		{
+			buf_append(&text, " ", i > 0);
+			buf_append(&text, expanded.words[i], strlen(expanded.words[i]));
+			free(expanded.words[i]);
+		}
+		free(expanded.words);
+		if (redirect[0] == HERESTRING)
+			buf_append(&text, "\n", 1);
+		buf_append(&text, "", 1);
+		body = text.data;
+		len = text.len - 1;
+	}
+	if (expansion_failed)
+	{
+		if (body != redirect + 1)
+			free(body);
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = -1, fds[2];
+	if (len <= HEREDOC_PIPE_MAX && pipe2(fds, O_CLOEXEC) == 0)
+	{
+		// the default size, unless the user is over the pipe page limit
+		if ((long)len <= fcntl(fds[1], F_GETPIPE_SZ) && write_all(fds[1], body, len))
+			fd = fds[0];
+		else
+			close(fds[0]);
+		close(fds[1]);
+	}
+	if (fd == -1)
+	{
+		fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+		if (fd != -1 && (!write_all(fd, body, len) || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+						 lseek(fd, 0, SEEK_SET) == -1))
+		{
+			int error = errno;
+			close(fd);
+			fd = -1;
+			errno = error;
+		}
+	}
+	if (body != redirect + 1)
+		free(body);
+	return fd;
+}
+
+/**
+ * Point stdin/stdout at the redirection targets, keeping the originals to restore later
+ * @return 0, or -1 if a target can't be opened
+ */
+int redirect_begin(char **redirects, struct redirect_plan *plan)
+{
+	plan->saved[0] = plan->saved[1] = -1;
+	if (redirects[0] == NULL && redirects[1] == NULL && redirects[2] == NULL)
+		return 0;
+	fflush(stdout);
+	for (int i = 0; i < 3; i++)
+	{
+		if (redirects[i] == NULL)
+			continue;
+		int flags = i == 0 ? O_RDONLY : (O_WRONLY | O_CREAT | (i == 1 ? O_TRUNC : O_APPEND));
+		bool heredoc = i == 0 && is_heredoc(redirects[i]);
+		int fd = heredoc ? heredoc_open(redirects[i]) : open(redirects[i], flags | O_CLOEXEC, 0666);
+		if (fd == -1)
+		{
+			// a failed $(( )) has already said why
+			if (!heredoc || !expansion_failed)
+				printf("-%s: %s: %s\n", sysname, heredoc ? "heredoc" : redirects[i], strerror(errno));
+			redirect_end(plan);
+			return -1;
+		}
+		int target = i == 0 ? STDIN_FILENO : STDOUT_FILENO;
+		if (plan->saved[target] == -1)
+			plan->saved[target] = fcntl(target, F_DUPFD_CLOEXEC, 10);
+		dup2(fd, target);
+		close(fd);
+	}
+	return 0;
+}
+
+void redirect_end(struct redirect_plan *plan)
+{
+	fflush(stdout);
+	for (int i = 0; i < 2; i++)
+		if (plan->saved[i] != -1)
+		{
+			dup2(plan->saved[i], i);
+			close(plan->saved[i]);
+			plan->saved[i] = -1;
+		}
+}
+
+int wait_status(pid_t pid)
+{
+	int status;
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return 127;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// rightmost simple command of a tree, where the words after an alias are attached
+struct command_t *last_simple_command(struct node_t *node)
+{
+	while (node != NULL)
+	{
+		switch (node->type)
+		{
+		case NODE_COMMAND:
+			return node->command;
+		case NODE_LIST:
+		case NODE_PIPELINE:
+			node = node->children[node->child_count - 1];
+			break;
+		case NODE_AND:
+		case NODE_OR:
+			node = node->right;
+			break;
+		case NODE_NOT:
+		case NODE_BACKGROUND:
+			node = node->child;
+			break;
+		default:
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+int run_alias(struct definition_t *alias, struct node_t *node, bool tail, bool background)
+{
+	if (alias->body == NULL)
+		return SUCCESS;
+	struct node_t *expanded = clone_node(alias->body);
+
+	// words after the alias name land at the end of the expansion, like a textual alias would
+	struct command_t *last = last_simple_command(expanded);
+	struct command_t *command = node->command;
+	if (last != NULL)
+	{
+		last->args = realloc(last->args, sizeof(char *) * (last->arg_count + command->arg_count + 1));
+		for (int i = 0; i < command->arg_count; i++)
+			last->args[last->arg_count++] = strdup(command->args[i]);
+		for (int i = 0; i < 3; i++)
+			if (command->redirects[i] && !last->redirects[i])
+				last->redirects[i] = strdup(command->redirects[i]);
+		last->background |= command->background;
+	}
+
+	// a backgrounded alias may expand to a list or a builtin, so its whole body runs in a subshell
+	int code = SUCCESS;
+	alias->expanding = true;
+	if (background)
+	{
+		fflush(stdout);
+		if (fork() == 0)
+		{
+			execute_node(expanded, true);
+			fflush(stdout);
+			exit(last_status);
+		}
+		last_status = 0;
+	}
+	else
+		code = execute_node(expanded, tail);
+	alias->expanding = false;
+	if (alias->removed)
+		free_definition(alias);
+	free_node(expanded);
+	return code;
+}
+
+int execute_simple(struct node_t *node, bool tail, bool background)
+{
+	// aliases are resolved on the unexpanded words so the arguments are only expanded once
+	struct definition_t *alias = find_definition(alias_table, node->command->name);
+	if (alias != NULL && !alias->expanding)
+		return run_alias(alias, node, tail, background);
+
+	struct command_t *command = expand_command(node->command);
+	if (command == NULL)
+	{
+		release_substitutions();
+		last_status = 1;
+		return SUCCESS;
+	}
+	command->background |= background;
+
+	// NAME=value alone sets shell variables; in front of a command run in this shell it holds
+	// for that command only, an external command gets it laid over its environment instead
+	struct variable_t **saved = NULL;
+	bool in_shell = command->name[0] == 0 || find_definition(function_table, command->name) != NULL || is_shell_builtin(command->name);
+	if (command->assignment_count > 0 && in_shell)
+	{
+		if (command->name[0] != 0)
+			saved = save_variables(command->assignments, command->assignment_count);
+		for (int i = 0; i < command->assignment_count; i++)
+		{
+			char *eq = strchr(command->assignments[i], '=');
+			*eq = 0;
+			set_variable(command->assignments[i], eq + 1, saved != NULL);
+			*eq = '=';
+		}
+		if (command->name[0] == 0)
+			last_status = 0;
+	}
+
+	int code = SUCCESS;
+	struct redirect_plan plan;
+	if (redirect_begin(command->redirects, &plan) == 0)
+	{
+		no_fork = tail && !command->background;
+		code = process_command(command);
+		no_fork = false;
+		redirect_end(&plan);
+	}
+	else
+		last_status = 1;
+	if (saved != NULL)
+		restore_variables(command->assignments, command->assignment_count, saved);
+	release_substitutions();
+	free_command(command);
+	return code;
+}
+
+int execute_pipeline(struct node_t *node)
+{
+	int n = node->child_count, in_fd = -1;
+	pid_t *pids = malloc(sizeof(pid_t) * n);
+	fflush(stdout);
+	for (int i = 0; i < n; i++)
+	{
+		int fds[2] = {-1, -1};
+		if (i < n - 1 && pipe(fds) == -1)
+		{
+			printf("-%s: pipe: %s\n", sysname, strerror(errno));
+			n = i;
+			break;
+		}
+		pids[i] = fork();
+		if (pids[i] == 0)
+		{
+			if (in_fd != -1)
+			{
+				dup2(in_fd, STDIN_FILENO);
+				close(in_fd);
+			}
+			if (fds[1] != -1)
+			{
+				dup2(fds[1], STDOUT_FILENO);
+				close(fds[1]);
+				close(fds[0]);
+			}
+			execute_node(node->children[i], true);
+			fflush(stdout);
+			exit(last_status);
+		}
+		if (in_fd != -1)
+			close(in_fd);
+		if (fds[1] != -1)
+			close(fds[1]);
+		in_fd = fds[0];
+	}
+	if (in_fd != -1)
+		close(in_fd);
+	for (int i = 0; i < n; i++)
+	{
+		int status = wait_status(pids[i]);
+		if (i == n - 1)
+			last_status = status;
+	}
+	free(pids);
+	return SUCCESS;
+}
+
+/**
+ * Execute a parsed tree
+ * @param  node [description]
+ * @param  tail true when nothing else runs in this process afterwards, so it may exec in place
+ * @return      SUCCESS, or EXIT when the shell should exit; the status is in last_status
+ */
+int execute_node(struct node_t *node, bool tail)
+{
+	int code = SUCCESS;
+	struct redirect_plan plan;
+	pid_t pid;
+	if (node == NULL)
+		return SUCCESS;
+
+	switch (node->type)
+	{
+	case NODE_COMMAND:
+		return execute_simple(node, tail, false);
+
+	case NODE_LIST:
+		for (int i = 0; i < node->child_count && code != EXIT && !unwinding(); i++)
+			code = execute_node(node->children[i], tail && i == node->child_count - 1);
+		return code;
+
+	case NODE_AND:
+	case NODE_OR:
+		code = execute_node(node->left, false);
+		if (code == EXIT || unwinding())
+			return code;
+		if ((last_status == 0) == (node->type == NODE_AND))
+			code = execute_node(node->right, tail);
+		return code;
+
+	case NODE_NOT:
+		code = execute_node(node->child, false);
+		last_status = !last_status;
+		return code;
+
+	case NODE_PIPELINE:
+		return execute_pipeline(node);
+
+	case NODE_GROUP:
+		if (redirect_begin(node->redirects, &plan) == -1)
+		{
+			last_status = 1;
+			return SUCCESS;
+		}
+		code = execute_node(node->child, tail && plan.saved[0] == -1 && plan.saved[1] == -1);
+		redirect_end(&plan);
+		return code;
+
+	case NODE_SUBSHELL:
+		// a child that has nothing left to do after the subshell can run it in place
+		fflush(stdout);
+		pid = tail ? 0 : fork();
+		if (pid == 0)
+		{
+			if (redirect_begin(node->redirects, &plan) == -1)
+				exit(1);
+			execute_node(node->child, true);
+			fflush(stdout);
+			exit(last_status);
+		}
+		last_status = wait_status(pid);
+		return SUCCESS;
+
+	case NODE_BACKGROUND:
+		// a lone external command only needs the fork process_command() already does, anything
+		// that would run inside the shell goes to a subshell
+		if (node->child->type == NODE_COMMAND)
+		{
+			const char *name = node->child->command->name;
+			if (find_definition(alias_table, name) == NULL && find_definition(function_table, name) == NULL && !is_shell_builtin(name))
+				return execute_simple(node->child, false, true);
+		}
+		fflush(stdout);
+		if (fork() == 0)
+		{
+			execute_node(node->child, true);
+			fflush(stdout);
+			exit(last_status);
+		}
+		last_status = 0;
+		return SUCCESS;
+
+	case NODE_FUNCTION:
+		// the body is copied out of the tree, which is freed once the line has run
+		set_definition(function_table, node->name, node->text, clone_node(node->child));
+		last_status = 0;
+		return SUCCESS;
+
+	case NODE_IF:
+	case NODE_WHILE:
+	case NODE_UNTIL:
+	case NODE_FOR:
+	case NODE_CASE:
+		if (redirect_begin(node->redirects, &plan) == -1)
+		{
+			last_status = 1;
+			return SUCCESS;
+		}
+		code = execute_compound(node, tail && plan.saved[0] == -1 && plan.saved[1] == -1);
+		redirect_end(&plan);
+		return code;
+
+	case NODE_PATTERN:
+		break;
+	}
+	return SUCCESS;
+}
+
+/// Control flow: conditionals and loops walk their parsed bodies again on every pass, nothing is re-parsed
+
+bool unwinding()
+{
+	return pending_break > 0 || pending_continue > 0 || pending_return;
+}
+
+/**
+ * Called by a loop after its body ran
+ * @return true if the loop has to stop
+ */
+bool loop_should_stop()
+{
+	if (pending_return)
+		return true;
+	if (pending_break > 0)
+	{
+		pending_break--;
+		return true;
+	}
+	if (pending_continue > 0)
+		return --pending_continue > 0; // continue 1 keeps this loop going
+	return false;
+}
+
+// a case pattern matches the subject like a glob, after expansion
+bool case_matches(const char *subject, const char *raw)
+{
+	struct word_list pattern = {0};
+	expand_word(raw, &pattern, false);
+	bool match = fnmatch(pattern.words[0], subject, 0) == 0;
+	free(pattern.words[0]);
+	free(pattern.words);
+	return match;
+}
+
+int execute_compound(struct node_t *node, bool tail)
+{
+	int code = SUCCESS, status = 0;
+	switch (node->type)
+	{
+	case NODE_IF:
+		code = execute_node(node->left, false);
+		if (code == EXIT || unwinding())
+			return code;
+		if (last_status == 0)
+			return execute_node(node->child, tail);
+		if (node->right != NULL)
+			return execute_node(node->right, tail);
+		last_status = 0;
+		return SUCCESS;
+
+	case NODE_WHILE:
+	case NODE_UNTIL:
+		loop_depth++;
+		while (1)
+		{
+			code = execute_node(node->left, false);
+			if (code == EXIT || unwinding())
+				break;
+			if ((last_status == 0) != (node->type == NODE_WHILE))
+				break;
+			code = execute_node(node->child, false);
+			status = last_status;
+			if (code == EXIT || loop_should_stop())
+				break;
+		}
+		loop_depth--;
+		if (!pending_return)
+			last_status = status;
+		return code;
+
+	case NODE_FOR:
+	{
+		// the words are expanded once, before the first pass
+		struct word_list items = {0};
+		for (int i = 0; i < node->word_count; i++)
+			expand_word(node->words[i], &items, true);
+		loop_depth++;
+		for (int i = 0; i < items.count && code != EXIT; i++)
+		{
+			set_variable(node->name, items.words[i], false);
+			code = execute_node(node->child, false);
+			status = last_status;
+			if (loop_should_stop())
+				break;
+		}
+		loop_depth--;
+		for (int i = 0; i < items.count; i++)
+			free(items.words[i]);
+		free(items.words);
+		if (!pending_return)
+			last_status = status;
+		return code;
+	}
+
+	case NODE_CASE:
+	{
+		struct word_list subject = {0};
+		expand_word(node->name, &subject, false);
+		last_status = 0;
+		for (int i = 0; i < node->child_count; i++)
+		{
+			struct node_t *branch = node->children[i];
+			for (int j = 0; j < branch->word_count; j++)
+				if (case_matches(subject.words[0], branch->words[j]))
+				{
+					code = execute_node(branch->child, tail);
+					i = node->child_count;
+					break;
+				}
+		}
+		free(subject.words[0]);
+		free(subject.words);
+		return code;
+	}
+
+	default:
+		return SUCCESS;
+	}
+}
+
+// break [n] and continue [n]
+int loop_builtin(struct command_t *command)
+{
+	int n = command->arg_count > 0 ? atoi(command->args[0]) : 1;
+	if (n < 1)
+	{
+		printf("-%s: %s: %s: loop count out of range\n", sysname, command->name, command->args[0]);
+		last_status = 1;
+		return SUCCESS;
+	}
+	if (loop_depth == 0)
+	{
+		printf("-%s: %s: only meaningful in a 'for', 'while', or 'until' loop\n", sysname, command->name);
+		last_status = 0;
+		return SUCCESS;
+	}
+	if (n > loop_depth)
+		n = loop_depth;
+	if (command->name[0] == 'b')
+		pending_break = n;
+	else
+		pending_continue = n;
+	last_status = 0;
+	return SUCCESS;
+}
+
+int return_builtin(struct command_t *command)
+{
+	if (function_depth == 0)
+	{
+		printf("-%s: return: can only 'return' from a function or sourced script\n", sysname);
+		last_status = 1;
+		return SUCCESS;
+	}
+	if (command->arg_count > 0)
+		last_status = atoi(command->args[0]) & 0xff;
+	pending_return = true;
+	return SUCCESS;
+}
+
+int compare_definitions(const void *a, const void *b)
+{
+	return strcmp((*(struct definition_t **)a)->name, (*(struct definition_t **)b)->name);
+}
+
+/**
+ * Collect a table sorted by name
+ * @return number of definitions, the array must be freed
+ */
+int sorted_definitions(struct definition_t **table, struct definition_t ***out)
+{
+	int count = 0;
+	*out = NULL;
+	for (int i = 0; i < DEFINITION_BUCKETS; i++)
+		for (struct definition_t *d = table[i]; d; d = d->next)
+		{
+			*out = realloc(*out, sizeof(struct definition_t *) * (count + 1));
+			(*out)[count++] = d;
+		}
+	qsort(*out, count, sizeof(struct definition_t *), compare_definitions);
+	return count;
+}
+
+void print_alias(struct definition_t *alias)
+{
+	printf("alias %s='", alias->name);
+	for (const char *p = alias->text; *p; p++)
+	{
+		if (*p == '\'')
+			printf("'\\''");
+		else
+			putchar(*p);
+	}
+	printf("'\n");
+}
+
+int alias_builtin(struct command_t *command)
+{
+	last_status = 0;
+	if (command->arg_count == 0 || strcmp(command->args[0], "-p") == 0)
+	{
+		struct definition_t **list;
+		int count = sorted_definitions(alias_table, &list);
+		for (int i = 0; i < count; i++)
+			print_alias(list[i]);
+		free(list);
+		return SUCCESS;
+	}
+
+	for (int i = 0; i < command->arg_count; i++)
+	{
+		char *value = strchr(command->args[i], '=');
+		if (value == NULL)
+		{
+			// alias name prints a single definition
+			struct definition_t *alias = find_definition(alias_table, command->args[i]);
+			if (alias != NULL)
+				print_alias(alias);
+			else
+			{
+				printf("-%s: alias: %s: not found\n", sysname, command->args[i]);
+				last_status = 1;
+			}
+			continue;
+		}
+		*value = 0;
+		define_alias(command->args[i], value + 1);
+		*value = '=';
+	}
+	return SUCCESS;
+}
+
+int unalias_builtin(struct command_t *command)
+{
+	last_status = 0;
+	if (command->arg_count > 0 && strcmp(command->args[0], "-a") == 0)
+	{
+		for (int i = 0; i < DEFINITION_BUCKETS; i++)
+			while (alias_table[i])
+				remove_definition(alias_table, alias_table[i]->name);
+		return SUCCESS;
+	}
+	for (int i = 0; i < command->arg_count; i++)
+		if (!remove_definition(alias_table, command->args[i]))
+		{
+			printf("-%s: unalias: %s: not found\n", sysname, command->args[i]);
+			last_status = 1;
+		}
+	return SUCCESS;
+}
+
+/// Fuzzy matching: a query matches a text when its characters appear in it in order, ignoring case
+
+#define FUZZY_PAD 32 // readable bytes past the end of a scored text, fuzzy_find() reads whole vectors
+
+/**
+ * One bit per letter or digit the text contains, ignoring case; other characters share the last bit.
+ * A text can only match a query whose signature bits it all has.
+ */
+uint64_t fuzzy_signature(const char *text, int len)
+{
+	uint64_t bits = 0;
+	for (int i = 0; i < len; i++)
+	{
+		unsigned char c = text[i];
+		if (c >= 'A' && c <= 'Z')
+			c += 32;
+		bits |= 1ull << (c >= 'a' && c <= 'z' ? c - 'a' : c >= '0' && c <= '9' ? 26 + c - '0' : 63);
+	}
+	return bits;
+}
+
+/**
+ * First occurrence of c in text[from, len), either case, one byte at a time
+ * @return index, -1 if there is none
+ */
+static inline int fuzzy_find_scalar(const char *text, int from, int len, char lower, char upper)
+{
+	for (; from < len; from++)
+		if (text[from] == lower || text[from] == upper)
+			return from;
+	return -1;
+}
+
+#ifdef __SSE2__
+// 16 bytes per step, bits past the end of the text are masked off instead of finishing byte by byte
+static inline int fuzzy_find_sse2(const char *text, int from, int len, char lower, char upper)
+{
+	__m128i want_lower = _mm_set1_epi8(lower), want_upper = _mm_set1_epi8(upper);
+	for (; from < len; from += 16)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(text + from));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, want_lower), _mm_cmpeq_epi8(chunk, want_upper)));
+		if (len - from < 16)
+			mask &= (1u << (len - from)) - 1;
+		if (mask != 0)
+			return from + __builtin_ctz(mask);
+	}
+	return -1;
+}
+#endif
+
+#ifdef FUZZY_AVX2
+// the same with 32 byte vectors, only called after the CPU was checked for AVX2
+__attribute__((target("avx2"))) static inline int fuzzy_find_avx2(const char *text, int from, int len, char lower, char upper)
+{
+	__m256i want_lower = _mm256_set1_epi8(lower), want_upper = _mm256_set1_epi8(upper);
+	for (; from < len; from += 32)
+	{
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(text + from));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, want_lower), _mm256_cmpeq_epi8(chunk, want_upper)));
+		if (len - from < 32)
+			mask &= (1u << (len - from)) - 1;
+		if (mask != 0)
+			return from + __builtin_ctz(mask);
+	}
+	return -1;
+}
+#endif
+
+/**
+ * Score text against a query whose characters must all appear in it in order, ignoring case.
+ * Matches right after a separator, runs of consecutive matches and matches in the last path
+ * component count more; gaps count against.
+ * @param  text followed by FUZZY_PAD readable bytes
+ * @param  find one of the fuzzy_find_ functions, inlined into each fuzzy_score_ variant
+ * @return      0 if the query does not match
+ */
+static inline __attribute__((always_inline)) int fuzzy_score_with(const char *text, int len, const char *query, int query_len,
+																  int (*find)(const char *, int, int, char, char))
+{
+	if (query_len == 0)
+		return 1;
+	// the query is tried against the whole path, and when that matches against the last component alone
+	int base = len, best = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1)
+			while (base > 0 && text[base - 1] != '/')
+				base--;
+		int start = pass == 0 ? 0 : base;
+		int score = 0, prev = -1, pos = start;
+		int q = 0;
+		for (; q < query_len; q++)
+		{
+			char c = query[q];
+			pos = find(text, pos, len, c >= 'A' && c <= 'Z' ? c + 32 : c, c >= 'a' && c <= 'z' ? c - 32 : c);
+			if (pos == -1)
+				break;
+			score += 16;
+			char before = pos == 0 ? '/' : text[pos - 1];
+			if (before == '/' || before == '-' || before == '_' || before == '.' || before == ' ')
+				score += 32;
+			if (prev != -1 && pos == prev + 1)
+				score += 24;
+			else if (prev != -1)
+				score -= pos - prev - 1 < 16 ? pos - prev - 1 : 16;
+			prev = pos++;
+		}
+		if (q < query_len)
+			break;
+		if (pass == 1)
+			score += 64 + (len - base == query_len ? 256 : 0); // all in the last component, or equal to it
+		if (score < 1)
+			score = 1;
+		if (score > best)
+			best = score;
+	}
+	return best;
+}
+
+int fuzzy_score_scalar(const char *text, int len, const char *query, int query_len)
+{
+	return fuzzy_score_with(text, len, query, query_len, fuzzy_find_scalar);
+}
+
+#ifdef __SSE2__
+int fuzzy_score_sse2(const char *text, int len, const char *query, int query_len)
+{
+	return fuzzy_score_with(text, len, query, query_len, fuzzy_find_sse2);
+}
+#endif
+
+#ifdef FUZZY_AVX2
+__attribute__((target("avx2"))) int fuzzy_score_avx2(const char *text, int len, const char *query, int query_len)
+{
+	return fuzzy_score_with(text, len, query, query_len, fuzzy_find_avx2);
+}
+#endif
+
+int fuzzy_score_detect(const char *text, int len, const char *query, int query_len);
+// the widest variant this CPU runs, picked on the first call
+int (*fuzzy_score)(const char *text, int len, const char *query, int query_len) = fuzzy_score_detect;
+pthread_once_t fuzzy_score_once = PTHREAD_ONCE_INIT;
+
+void fuzzy_score_pick()
+{
+	int (*picked)(const char *, int, const char *, int) = fuzzy_score_scalar;
+#ifdef __SSE2__
+	picked = fuzzy_score_sse2;
+#endif
+#ifdef FUZZY_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		picked = fuzzy_score_avx2;
+#endif
+	fuzzy_score = picked;
+}
+
+int fuzzy_score_detect(const char *text, int len, const char *query, int query_len)
+{
+	pthread_once(&fuzzy_score_once, fuzzy_score_pick);
+	return fuzzy_score(text, len, query, query_len);
+}
+
+/// Frecency: every directory cd reaches is kept in ~/.shellington_frecency, an mmapped table
+/// shared by all running shells. short jump picks the visited directory that best fits a
+/// fuzzy query, weighted by how often and how recently it was visited.
+
+#define FRECENCY_FILE ".shellington_frecency"
+#define FRECENCY_MAGIC "SHLFREC"
+#define FRECENCY_VERSION 1
+#define FRECENCY_MAX_RANK 100000.0 // once the ranks add up to this, all of them age by 10%
+
+struct frecency_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;		// entries in use
+	uint32_t capacity;	// entries the file has room for
+	uint32_t pool_used; // bytes of path text in use
+	uint32_t pool_size;
+	uint32_t pad;
+	double total_rank;
+};
+// followed by capacity entries and then the path pool
+struct frecency_entry
+{
+	double rank;		 // visits, aged
+	int64_t last_visit;	 // seconds since the epoch
+	uint32_t path_off;	 // into the pool
+	uint32_t path_len;
+	uint64_t signature;	 // fuzzy_signature() of the path
+};
+
+int frecency_fd = -1;
+struct frecency_header *frecency = NULL;
+size_t frecency_size = 0;
+
+#define FRECENCY_ENTRIES(h) ((struct frecency_entry *)((h) + 1))
+#define FRECENCY_POOL(h) ((char *)(FRECENCY_ENTRIES(h) + (h)->capacity))
+
+/**
+ * Write a fresh table into the file, keeping the entries that are still ranked at least 1
+ * @param  capacity  entries to make room for
+ * @param  pool_size bytes of path text to make room for
+ * @return           false if the file could not be written
+ */
+bool frecency_rebuild(uint32_t capacity, uint32_t pool_size)
+{
+	size_t size = sizeof(struct frecency_header) + capacity * sizeof(struct frecency_entry) + pool_size;
+	struct frecency_header *h = calloc(1, size);
+	memcpy(h->magic, FRECENCY_MAGIC, sizeof(h->magic));
+	h->version = FRECENCY_VERSION;
+	h->capacity = capacity;
+	h->pool_size = pool_size;
+	if (frecency != NULL)
+	{
+		struct frecency_entry *old = FRECENCY_ENTRIES(frecency);
+		for (uint32_t i = 0; i < frecency->count; i++)
+		{
+			if (old[i].rank < 1.0 || h->count == capacity || h->pool_used + old[i].path_len + 1 + FUZZY_PAD > pool_size)
+				continue;
+			struct frecency_entry *e = &FRECENCY_ENTRIES(h)[h->count++];
+			*e = old[i];
+			e->path_off = h->pool_used;
+			memcpy(FRECENCY_POOL(h) + e->path_off, FRECENCY_POOL(frecency) + old[i].path_off, old[i].path_len + 1);
+			h->pool_used += old[i].path_len + 1;
+			h->total_rank += e->rank;
+		}
+		munmap(frecency, frecency_size);
+		frecency = NULL;
+	}
+	bool written = ftruncate(frecency_fd, size) == 0 && pwrite(frecency_fd, h, size, 0) == (ssize_t)size;
+	free(h);
+	if (!written)
+		return false;
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, frecency_fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	frecency = map;
+	frecency_size = size;
+	return true;
+}
+
+/**
+ * Check a mapped table before anything reads it: the counts fit the file, and every path lies
+ * in the used part of the pool and ends in a NUL
+ */
+bool frecency_sane(const struct frecency_header *h, size_t size)
+{
+	if (memcmp(h->magic, FRECENCY_MAGIC, sizeof(h->magic)) != 0 || h->version != FRECENCY_VERSION)
+		return false;
+	size_t needed = sizeof(struct frecency_header) + (size_t)h->capacity * sizeof(struct frecency_entry) + h->pool_size;
+	if (needed > size || h->count > h->capacity || (uint64_t)h->pool_used + FUZZY_PAD > h->pool_size)
+		return false;
+	const struct frecency_entry *entries = FRECENCY_ENTRIES(h);
+	const char *pool = FRECENCY_POOL(h);
+	for (uint32_t i = 0; i < h->count; i++)
+		if ((uint64_t)entries[i].path_off + entries[i].path_len >= h->pool_used || pool[entries[i].path_off + entries[i].path_len] != 0)
+			return false;
+	return true;
+}
+
+/**
+ * Map the table, or map it again when another shell has grown it
+ * @param  lock LOCK_SH or LOCK_EX, held when this returns true
+ * @return      false if there is no usable table
+ */
+bool frecency_open(int lock)
+{
+	if (frecency_fd == -1)
+	{
+		const char *home = get_variable("HOME");
+		if (home == NULL)
+			return false;
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", home, FRECENCY_FILE);
+		frecency_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (frecency_fd == -1)
+			return false;
+	}
+	flock(frecency_fd, lock);
+	struct stat st;
+	if (fstat(frecency_fd, &st) == -1)
+		goto fail;
+	if (frecency != NULL && (size_t)st.st_size != frecency_size)
+	{
+		munmap(frecency, frecency_size);
+		frecency = NULL;
+	}
+	if (frecency == NULL && st.st_size >= (off_t)sizeof(struct frecency_header))
+	{
+		void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, frecency_fd, 0);
+		if (map == MAP_FAILED)
+			goto fail;
+		frecency = map;
+		frecency_size = st.st_size;
+	}
+	// checked on every open, another shell writes the same mapping
+	if (frecency != NULL && !frecency_sane(frecency, frecency_size))
+	{
+		munmap(frecency, frecency_size);
+		frecency = NULL;
+	}
+	if (frecency == NULL)
+	{
+		// a missing, foreign, outdated or damaged file starts over; that needs the write lock
+		if (lock != LOCK_EX)
+			goto fail;
+		if (!frecency_rebuild(256, 16384))
+			goto fail;
+	}
+	return true;
+fail:
+	flock(frecency_fd, LOCK_UN);
+	return false;
+}
+
+// count a visit to dir
+void frecency_record(const char *dir)
+{
+	if (!frecency_open(LOCK_EX))
+		return;
+	uint32_t len = strlen(dir);
+	struct frecency_entry *entries = FRECENCY_ENTRIES(frecency);
+	struct frecency_entry *e = NULL;
+	for (uint32_t i = 0; i < frecency->count && e == NULL; i++)
+		if (entries[i].path_len == len && memcmp(FRECENCY_POOL(frecency) + entries[i].path_off, dir, len) == 0)
+			e = &entries[i];
+	if (e == NULL)
+	{
+		if (frecency->count == frecency->capacity || frecency->pool_used + len + 1 + FUZZY_PAD > frecency->pool_size)
+		{
+			uint32_t pool = frecency->pool_size * 2;
+			while (pool < frecency->pool_used + len + 1 + FUZZY_PAD)
+				pool *= 2;
+			if (!frecency_rebuild(frecency->capacity * 2, pool))
+			{
+				flock(frecency_fd, LOCK_UN);
+				return;
+			}
+			entries = FRECENCY_ENTRIES(frecency);
+		}
+		e = &entries[frecency->count++];
+		e->rank = 0;
+		e->path_off = frecency->pool_used;
+		e->path_len = len;
+		e->signature = fuzzy_signature(dir, len);
+		memcpy(FRECENCY_POOL(frecency) + e->path_off, dir, len + 1);
+		frecency->pool_used += len + 1;
+	}
+	e->rank += 1;
+	e->last_visit = time(NULL);
+	frecency->total_rank += 1;
+
+	if (frecency->total_rank > FRECENCY_MAX_RANK)
+	{
+		// aging: old favourites fade, and directories that dropped below one visit are forgotten
+		for (uint32_t i = 0; i < frecency->count; i++)
+			entries[i].rank *= 0.9;
+		frecency_rebuild(frecency->capacity, frecency->pool_size);
+	}
+	flock(frecency_fd, LOCK_UN);
+}
+
+// visits weighted by how recent the last one was
+double frecency_weight(const struct frecency_entry *e, int64_t now)
+{
+	int64_t age = now - e->last_visit;
+	double recency = age < 3600 ? 4.0 : age < 86400 ? 2.0 : age < 604800 ? 0.5 : 0.25;
+	return e->rank * recency;
+}
+
+/**
+ * The visited directory that best matches query
+ * @return newly allocated path, NULL if nothing matches
+ */
+char *frecency_best(const char *query)
+{
+	if (!frecency_open(LOCK_SH))
+		return NULL;
+	struct frecency_entry *entries = FRECENCY_ENTRIES(frecency);
+	const char *pool = FRECENCY_POOL(frecency);
+	int query_len = strlen(query);
+	uint64_t query_signature = fuzzy_signature(query, query_len);
+	int64_t now = time(NULL);
+	char *found = NULL;
+	bool *skip = calloc(frecency->count + 1, sizeof(bool));
+	while (found == NULL)
+	{
+		double best = 0;
+		int best_index = -1;
+		for (uint32_t i = 0; i < frecency->count; i++)
+		{
+			if (skip[i] || (entries[i].signature & query_signature) != query_signature)
+				continue;
+			int score = fuzzy_score(pool + entries[i].path_off, entries[i].path_len, query, query_len);
+			if (score == 0)
+				continue;
+			// the match decides first; frecency lifts it by up to 2x, enough to break ties and beat weak matches
+			double weight = frecency_weight(&entries[i], now);
+			double total = score * (1.0 + weight / (weight + 10.0));
+			if (total > best)
+			{
+				best = total;
+				best_index = i;
+			}
+		}
+		if (best_index == -1)
+			break;
+		// a directory that was removed since is passed over
+		struct stat st;
+		const char *path = pool + entries[best_index].path_off;
+		if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+			found = strdup(path);
+		skip[best_index] = true;
+	}
+	free(skip);
+	flock(frecency_fd, LOCK_UN);
+	return found;
+}
+
+/// History: every shell appends the lines it runs to ~/.shellington_history, an mmapped ring
+/// of fixed-size slots shared by all running shells. A writer reserves its slots with one atomic
+/// add on the header, so no lock is taken per command; readers pick up what the other shells
+/// wrote since their last look and skip records that a crashed or lapping writer left torn.
+
+#define HISTORY_FILE ".shellington_history"
+#define HISTORY_MAGIC "SHLHIST"
+#define HISTORY_VERSION 1
+#define HISTORY_SLOTS 8192	   // slots in the ring
+#define HISTORY_SLOT_SIZE 128  // bytes per slot, a record takes as many consecutive slots as it needs
+#define HISTORY_MAX_LEN 16384  // longer lines are kept in this session only
+
+struct history_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t pad;
+	uint64_t next __attribute__((aligned(64))); // slots reserved so far, slot n lives at n % slot_count
+};
+// followed by the slots; the first slot of a record starts with this header and the text follows it
+struct history_record
+{
+	uint64_t seq;	  // number of the slot the record was written to, stored last
+	uint64_t session; // shell that wrote it
+	int64_t time;	  // seconds since the epoch
+	uint32_t len;	  // bytes of text
+	uint32_t crc;	  // history_crc32() of the text
+};
+
+int history_fd = -1;
+struct history_header *history = NULL;
+uint64_t history_session = 0;				// tells this shell's records from the others'
+uint64_t history_cursor = 0;				// next slot history_sync() reads
+uint64_t history_stalled = UINT64_MAX;		// reserved but unwritten slot the last sync stopped at
+
+// lines of this and the other shells, oldest first
+char **history_lines = NULL;
+int history_count = 0;
+
+#define HISTORY_RING(h) ((char *)(h) + sizeof(struct history_header))
+#define HISTORY_RECORD(h, n) ((struct history_record *)(HISTORY_RING(h) + ((n) % (h)->slot_count) * (h)->slot_size))
+
+uint32_t history_crc32(const char *data, uint32_t len)
+{
+	static uint32_t table[256];
+	if (table[1] == 0)
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	uint32_t crc = 0xFFFFFFFF;
+	for (uint32_t i = 0; i < len; i++)
+		crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+// slots a record of len bytes of text takes
+uint64_t history_span(uint32_t len)
+{
+	return (sizeof(struct history_record) + len + HISTORY_SLOT_SIZE - 1) / HISTORY_SLOT_SIZE;
+}
+
+/**
+ * Copy between a buffer and the text of the record at slot n, which may wrap around the ring
+ * @param to_ring true to write data into the ring, false to read it out
+ */
+void history_copy(uint64_t n, char *data, uint32_t len, bool to_ring)
+{
+	size_t ring_size = (size_t)history->slot_count * history->slot_size;
+	size_t off = (n % history->slot_count) * history->slot_size + sizeof(struct history_record);
+	size_t first = len < ring_size - off ? len : ring_size - off;
+	char *ring = HISTORY_RING(history);
+	if (to_ring)
+	{
+		memcpy(ring + off, data, first);
+		memcpy(ring, data + first, len - first);
+	}
+	else
+	{
+		memcpy(data, ring + off, first);
+		memcpy(data + first, ring, len - first);
+	}
+}
+
+/**
+ * Map the ring, creating the file the first time any shell uses it
+ * @return false if there is no usable ring, the history then stays in this session
+ */
+bool history_map()
+{
+	if (history != NULL)
+		return true;
+	if (history_fd != -1)
+		return false; // failed before
+	const char *home = get_variable("HOME");
+	if (home == NULL)
+		return false;
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+	history_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (history_fd == -1)
+		return false;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	history_session = ((uint64_t)getpid() << 32) ^ ((uint64_t)now.tv_sec << 20) ^ now.tv_nsec;
+
+	// the lock is only held while the header is checked or written, once per shell
+	struct history_header h = {0};
+	size_t size = sizeof(h) + (size_t)HISTORY_SLOTS * HISTORY_SLOT_SIZE;
+	flock(history_fd, LOCK_EX);
+	struct stat st;
+	bool ok = fstat(history_fd, &st) == 0;
+	if (ok && st.st_size == 0)
+	{
+		memcpy(h.magic, HISTORY_MAGIC, sizeof(h.magic));
+		h.version = HISTORY_VERSION;
+		h.slot_count = HISTORY_SLOTS;
+		h.slot_size = HISTORY_SLOT_SIZE;
+		ok = ftruncate(history_fd, size) == 0 && pwrite(history_fd, &h, sizeof(h), 0) == sizeof(h);
+	}
+	else if (ok)
+	{
+		ok = pread(history_fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, HISTORY_MAGIC, sizeof(h.magic)) == 0 && h.version == HISTORY_VERSION && h.slot_count > 0 && h.slot_size >= sizeof(struct history_record) * 2;
+		size = sizeof(h) + (size_t)h.slot_count * h.slot_size;
+		ok = ok && (size_t)st.st_size >= size;
+	}
+	flock(history_fd, LOCK_UN);
+	if (!ok)
+		return false;
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, history_fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	history = map;
+	return true;
+}
+
+// append to the lines in memory, unless it repeats the last one
+bool history_remember(const char *line, int len)
+{
+	if (len == 0 || (history_count > 0 && strncmp(history_lines[history_count - 1], line, len) == 0 && history_lines[history_count - 1][len] == 0))
+		return false;
+	history_lines = realloc(history_lines, sizeof(char *) * (history_count + 1));
+	history_lines[history_count++] = strndup(line, len);
+	return true;
+}
+
+/**
+ * Pick up the records the other shells wrote since the last call
+ */
+void history_sync()
+{
+	if (!history_map())
+		return;
+	uint64_t next = __atomic_load_n(&history->next, __ATOMIC_ACQUIRE);
+	if (next - history_cursor > history->slot_count)
+		history_cursor = next - history->slot_count; // older slots have been written over
+	char *text = malloc(HISTORY_MAX_LEN + 1);
+	while (history_cursor < next)
+	{
+		struct history_record *rec = HISTORY_RECORD(history, history_cursor);
+		uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq != history_cursor)
+		{
+			// reserved but not written yet: give the writer until the next sync, then take it for dead
+			if (history_stalled != history_cursor)
+			{
+				history_stalled = history_cursor;
+				break;
+			}
+			history_cursor++;
+			continue;
+		}
+		uint64_t session = rec->session;
+		uint32_t len = rec->len, crc = rec->crc;
+		if (len > HISTORY_MAX_LEN || history_span(len) > next - history_cursor)
+		{
+			history_cursor++;
+			continue;
+		}
+		history_copy(history_cursor, text, len, false);
+		// a writer that lapped the ring meanwhile changed the seq or, further in, the text
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq || history_crc32(text, len) != crc)
+		{
+			history_cursor++;
+			continue;
+		}
+		history_cursor += history_span(len);
+		if (session != history_session)
+			history_remember(text, len);
+	}
+	free(text);
+}
+
+/**
+ * Publish a record in the ring
+ */
+void history_write(const char *line, uint32_t len)
+{
+	if (len > HISTORY_MAX_LEN || !history_map())
+		return;
+	uint64_t seq = __atomic_fetch_add(&history->next, history_span(len), __ATOMIC_ACQ_REL);
+	struct history_record *rec = HISTORY_RECORD(history, seq);
+	// readers still copying the record that was here see it go before its text changes
+	__atomic_store_n(&rec->seq, UINT64_MAX, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	rec->session = history_session;
+	rec->time = time(NULL);
+	rec->len = len;
+	rec->crc = history_crc32(line, len);
+	history_copy(seq, (char *)line, len, true);
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+void history_add(const char *line)
+{
+	while (*line == ' ' || *line == '\t')
+		line++;
+	int len = strlen(line);
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' '))
+		len--;
+	if (history_remember(line, len))
+		history_write(line, len);
+}
+
+int history_builtin(struct command_t *command)
+{
+	if (command->arg_count > 0 && strcmp(command->args[0], "-c") == 0)
+	{
+		// forget the lines in memory, the shared file keeps them
+		for (int i = 0; i < history_count; i++)
+			free(history_lines[i]);
+		history_count = 0;
+		last_status = 0;
+		return SUCCESS;
+	}
+	if (command->arg_count > 0 && strcmp(command->args[0], "-n") == 0)
+	{
+		history_sync();
+		last_status = 0;
+		return SUCCESS;
+	}
+	if (command->arg_count > 0 && strcmp(command->args[0], "-s") == 0)
+	{
+		// history -s words...: store the words as one line without running them
+		struct byte_buf line = {0};
+		for (int i = 1; i < command->arg_count; i++)
+		{
+			if (i > 1)
+				buf_append(&line, " ", 1);
+			buf_append(&line, command->args[i], strlen(command->args[i]));
+		}
+		buf_append(&line, "", 1);
+		history_add(line.data);
+		free(line.data);
+		last_status = 0;
+		return SUCCESS;
+	}
+	if (command->arg_count > 1 || (command->arg_count == 1 && (command->args[0][0] < '0' || command->args[0][0] > '9')))
+	{
+		printf("Usage: history [count] | -n | -s words... | -c\n");
+		last_status = 2;
+		return SUCCESS;
+	}
+	history_sync();
+	int shown = command->arg_count == 1 ? atoi(command->args[0]) : history_count;
+	for (int i = shown < history_count ? history_count - shown : 0; i < history_count; i++)
+		printf("%5d  %s\n", i + 1, history_lines[i]);
+	last_status = 0;
+	return SUCCESS;
+}
+
+/// Fuzzy finder: picks an entry of the history, the bookmarks or the shortcuts by typing part
+/// of it. Ctrl-R in the prompt searches the history, Ctrl-T bookmarks and shortcuts.
+
+#define FUZZY_ROWS 10			// results shown under the query
+#define FUZZY_THREAD_MIN 20000	// candidates before scoring is split across threads
+#define FUZZY_MAX_THREADS 8
+
+struct fuzzy_candidate
+{
+	uint32_t text_off; // shown and matched
+	uint32_t len;
+	uint32_t command_off; // what runs when it is picked
+	uint64_t signature;
+};
+
+struct fuzzy_corpus
+{
+	struct byte_buf pool; // NUL terminated texts, then FUZZY_PAD zero bytes
+	struct fuzzy_candidate *items;
+	int count;
+};
+
+void fuzzy_add(struct fuzzy_corpus *corpus, const char *text, const char *command)
+{
+	struct fuzzy_candidate c;
+	c.len = strlen(text);
+	c.text_off = buf_append(&corpus->pool, text, c.len + 1);
+	c.command_off = command == text ? c.text_off : buf_append(&corpus->pool, command, strlen(command) + 1);
+	c.signature = fuzzy_signature(text, c.len);
+	corpus->items = realloc(corpus->items, sizeof(struct fuzzy_candidate) * (corpus->count + 1));
+	corpus->items[corpus->count++] = c;
+}
+
+void fuzzy_collect(struct fuzzy_corpus *corpus, int sources)
+{
+	char line[BUF_SIZE], path[BUF_SIZE + 32];
+	if (sources & FUZZY_MARKS)
+	{
+		// bookmarktxt lines are: index "command"
+		snprintf(path, sizeof(path), "%s/bookmarktxt", w);
+		FILE *fp = fopen(path, "r");
+		while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+		{
+			line[strcspn(line, "\n")] = 0;
+			char *command = strchr(line, ' ');
+			if (command == NULL)
+				continue;
+			command++;
+			int len = strlen(command);
+			if (len >= 2 && command[0] == '"' && command[len - 1] == '"')
+			{
+				command[len - 1] = 0;
+				command++;
+			}
+			fuzzy_add(corpus, command, command);
+		}
+		if (fp != NULL)
+			fclose(fp);
+
+		// shorttxt lines are: alias:directory
+		snprintf(path, sizeof(path), "%s/shorttxt", w);
+		fp = fopen(path, "r");
+		while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+		{
+			line[strcspn(line, "\n")] = 0;
+			char *dir = strchr(line, ':');
+			if (dir == NULL)
+				continue;
+			*dir++ = 0;
+			char text[BUF_SIZE * 2 + 16], command[BUF_SIZE + 16];
+			snprintf(text, sizeof(text), "%s -> %s", line, dir);
+			snprintf(command, sizeof(command), "short jump %s", line);
+			fuzzy_add(corpus, text, command);
+		}
+		if (fp != NULL)
+			fclose(fp);
+	}
+	if (sources & FUZZY_HISTORY)
+	{
+		history_sync();
+		for (int i = 0; i < history_count; i++)
+		{
+			// a command of several lines is shown on one
+			char *shown = strdup(history_lines[i]);
+			for (char *p = shown; *p; p++)
+				if (*p == '\n')
+					*p = ' ';
+			fuzzy_add(corpus, shown, strcmp(shown, history_lines[i]) == 0 ? shown : history_lines[i]);
+			free(shown);
+		}
+	}
+	char pad[FUZZY_PAD] = {0};
+	buf_append(&corpus->pool, pad, sizeof(pad));
+}
+
+// a slice of the candidates, scored by one thread
+struct fuzzy_job
+{
+	const struct fuzzy_corpus *corpus;
+	const int *indices; // candidates to score, NULL for all of them
+	int begin, end;
+	const char *query;
+	int query_len;
+	uint64_t signature;
+	int *scores; // one per position in [begin, end)
+};
+
+void *fuzzy_run_job(void *arg)
+{
+	struct fuzzy_job *job = arg;
+	const char *pool = job->corpus->pool.data;
+	for (int i = job->begin; i < job->end; i++)
+	{
+		const struct fuzzy_candidate *c = &job->corpus->items[job->indices ? job->indices[i] : i];
+		job->scores[i] = (c->signature & job->signature) != job->signature ? 0 : fuzzy_score(pool + c->text_off, c->len, job->query, job->query_len);
+	}
+	return NULL;
+}
+
+/**
+ * Score candidates against a query, on worker threads when there are many of them
+ * @param indices candidates to score, NULL for the whole corpus
+ * @param count   number of candidates to score
+ * @param scores  receives one score per candidate, 0 for no match
+ */
+void fuzzy_score_all(const struct fuzzy_corpus *corpus, const int *indices, int count, const char *query, int *scores)
+{
+	struct fuzzy_job jobs[FUZZY_MAX_THREADS];
+	pthread_t threads[FUZZY_MAX_THREADS];
+	int thread_count = 1;
+	// the workers only read fuzzy_score, it is picked before any of them starts
+	pthread_once(&fuzzy_score_once, fuzzy_score_pick);
+	if (count >= FUZZY_THREAD_MIN)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = cpus < 1 ? 1 : cpus > FUZZY_MAX_THREADS ? FUZZY_MAX_THREADS : cpus;
+	}
+	for (int t = 0; t < thread_count; t++)
+	{
+		jobs[t] = (struct fuzzy_job){corpus, indices, (long)count * t / thread_count, (long)count * (t + 1) / thread_count,
+									 query, strlen(query), fuzzy_signature(query, strlen(query)), scores};
+		// this thread takes the first slice itself, and any slice a thread could not be started for
+		threads[t] = 0;
+		if (t > 0 && pthread_create(&threads[t], NULL, fuzzy_run_job, &jobs[t]) != 0)
+		{
+			threads[t] = 0;
+			fuzzy_run_job(&jobs[t]);
+		}
+	}
+	fuzzy_run_job(&jobs[0]);
+	for (int t = 1; t < thread_count; t++)
+		if (threads[t] != 0)
+			pthread_join(threads[t], NULL);
+}
+
+struct fuzzy_match
+{
+	int score;
+	int index;
+};
+
+// best score first; on a tie the later entry, the more recent one for history
+int compare_matches(const void *a, const void *b)
+{
+	const struct fuzzy_match *x = a, *y = b;
+	if (x->score != y->score)
+		return y->score - x->score;
+	return y->index - x->index;
+}
+
+/**
+ * Narrow the matches when the query grew by a character, since only what matched before can
+ * still match; otherwise score the whole corpus again
+ * @param matches in: candidates that matched the query without its last character, or NULL
+ * @return        number of candidates left in matches, best first
+ */
+int fuzzy_filter(const struct fuzzy_corpus *corpus, const char *query, const int *previous, int previous_count, int *matches)
+{
+	int count = previous ? previous_count : corpus->count;
+	int *scores = malloc(sizeof(int) * (count + 1));
+	fuzzy_score_all(corpus, previous, count, query, scores);
+	struct fuzzy_match *ranked = malloc(sizeof(struct fuzzy_match) * (count + 1));
+	int n = 0;
+	for (int i = 0; i < count; i++)
+		if (scores[i] > 0)
+			ranked[n++] = (struct fuzzy_match){scores[i], previous ? previous[i] : i};
+	qsort(ranked, n, sizeof(struct fuzzy_match), compare_matches);
+	for (int i = 0; i < n; i++)
+		matches[i] = ranked[i].index;
+	free(ranked);
+	free(scores);
+	return n;
+}
+
+void fuzzy_render(const struct fuzzy_corpus *corpus, const char *query, const int *matches, int count, int selected)
+{
+	struct winsize ws;
+	int width = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 4 ? ws.ws_col : 80;
+	int rows = count < FUZZY_ROWS ? count : FUZZY_ROWS;
+	printf("\r\033[J");
+	for (int i = 0; i < rows; i++)
+	{
+		const struct fuzzy_candidate *c = &corpus->items[matches[i]];
+		printf("\n%s%.*s%s", i == selected ? "\033[7m> " : "  ", width - 3, corpus->pool.data + c->text_off, i == selected ? "\033[0m" : "");
+	}
+	if (rows > 0)
+		printf("\033[%dA", rows);
+	printf("\r(%d/%d) %s", count, corpus->count, query);
+	fflush(stdout);
+}
+
+/**
+ * Let the user pick an entry on the terminal
+ * @param  sources  FUZZY_HISTORY, FUZZY_MARKS or both
+ * @param  query    text to start with
+ * @param  out      receives the command of the picked entry
+ * @return          true if an entry was picked, false when cancelled with Esc, Ctrl-C or Ctrl-G
+ */
+bool fuzzy_select(int sources, const char *query, char *out, size_t out_size)
+{
+	struct fuzzy_corpus corpus = {0};
+	fuzzy_collect(&corpus, sources);
+
+	struct termios saved, raw;
+	tcgetattr(STDIN_FILENO, &saved);
+	raw = saved;
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+	tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+	// one match list per query length, so a backspace goes back without scoring again
+	char text[256];
+	snprintf(text, sizeof(text), "%s", query);
+	int len = 0;
+	int *levels[sizeof(text)];
+	int level_counts[sizeof(text)];
+	levels[0] = malloc(sizeof(int) * (corpus.count + 1));
+	level_counts[0] = fuzzy_filter(&corpus, "", NULL, 0, levels[0]);
+	for (int i = 0; text[i]; i++)
+	{
+		len = i + 1;
+		char prefix[sizeof(text)];
+		snprintf(prefix, sizeof(prefix), "%.*s", len, text);
+		levels[len] = malloc(sizeof(int) * (level_counts[len - 1] + 1));
+		level_counts[len] = fuzzy_filter(&corpus, prefix, levels[len - 1], level_counts[len - 1], levels[len]);
+	}
+
+	int selected = 0;
+	bool picked = false;
+	while (1)
+	{
+		text[len] = 0;
+		fuzzy_render(&corpus, text, levels[len], level_counts[len], selected);
+		int c = read_key();
+		if (c == '\n' || c == '\r')
+		{
+			if (level_counts[len] > 0)
+			{
+				snprintf(out, out_size, "%s", corpus.pool.data + corpus.items[levels[len][selected]].command_off);
+				picked = true;
+			}
+			break;
+		}
+		if (c == EOF || c == 3 || c == 7 || c == 4) // Ctrl-C, Ctrl-G, Ctrl-D
+			break;
+		if (c == 27)
+		{
+			// an arrow key is ESC [ A or ESC [ B, a lone ESC cancels
+			struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+			if (poll(&pfd, 1, 50) <= 0 || read_key() != '[')
+				break;
+			c = read_key();
+			if (c == 'A' && selected > 0)
+				selected--;
+			else if (c == 'B' && selected + 1 < level_counts[len] && selected + 1 < FUZZY_ROWS)
+				selected++;
+			continue;
+		}
+		if (c == 16 && selected > 0) // Ctrl-P
+			selected--;
+		else if (c == 14 && selected + 1 < level_counts[len] && selected + 1 < FUZZY_ROWS) // Ctrl-N
+			selected++;
+		else if ((c == 127 || c == 8) && len > 0)
+		{
+			free(levels[len--]);
+			selected = 0;
+		}
+		else if (c >= ' ' && c < 127 && len + 1 < (int)sizeof(text))
+		{
+			// a longer query only narrows the previous matches
+			text[len++] = c;
+			text[len] = 0;
+			levels[len] = malloc(sizeof(int) * (level_counts[len - 1] + 1));
+			level_counts[len] = fuzzy_filter(&corpus, text, levels[len - 1], level_counts[len - 1], levels[len]);
+			selected = 0;
+		}
+	}
+	printf("\r\033[J");
+	fflush(stdout);
+	tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+
+	for (int i = 0; i <= len; i++)
+		free(levels[i]);
+	free(corpus.items);
+	free(corpus.pool.data);
+	return picked;
+}
 
-			for (int i = 0; i < command->arg_count; i++)
+/**
+ * fuzzy [-h | -m | -a] [-q query]: pick from the history (default), bookmarks and shortcuts, or both,
+ * and run the pick; with -q the matches are printed best first instead
+ */
+int fuzzy_builtin(struct command_t *command)
+{
+	int sources = FUZZY_HISTORY;
+	const char *query = NULL;
+	for (int i = 0; i < command->arg_count; i++)
+	{
+		if (strcmp(command->args[i], "-h") == 0)
+			sources = FUZZY_HISTORY;
+		else if (strcmp(command->args[i], "-m") == 0)
+			sources = FUZZY_MARKS;
+		else if (strcmp(command->args[i], "-a") == 0)
+			sources = FUZZY_ALL;
+		else if (strcmp(command->args[i], "-q") == 0 && i + 1 < command->arg_count)
+			query = command->args[++i];
+		else
+		{
+			printf("Usage: fuzzy [-h | -m | -a] [-q query]\n");
+			last_status = 2;
+			return SUCCESS;
+		}
+	}
+
+	if (query != NULL)
+	{
+		struct fuzzy_corpus corpus = {0};
+		fuzzy_collect(&corpus, sources);
+		int *matches = malloc(sizeof(int) * (corpus.count + 1));
+		int count = fuzzy_filter(&corpus, query, NULL, 0, matches);
+		for (int i = 0; i < count; i++)
+			puts(corpus.pool.data + corpus.items[matches[i]].text_off);
+		last_status = count == 0;
+		free(matches);
+		free(corpus.items);
+		free(corpus.pool.data);
+		return SUCCESS;
+	}
+
+	if (!isatty(STDIN_FILENO))
+	{
+		printf("-%s: fuzzy: stdin is not a terminal\n", sysname);
+		last_status = 1;
+		return SUCCESS;
+	}
+	char picked[4096];
+	if (!fuzzy_select(sources, "", picked, sizeof(picked)))
+	{
+		last_status = 130;
+		return SUCCESS;
+	}
+	printf("%s\n", picked);
+	history_add(picked);
+	return run_command_line(picked);
+}
+
+/// Session recording: record start runs the shell's output through a pty whose other end a
+/// pump thread copies to the terminal, so commands still see a terminal. The keys read by the
+/// prompt and that output are timestamped and queued; a writer thread packs them into
+/// LZ4-compressed chunks whose headers carry the time range, so replay skips to a point in
+/// time by reading headers only.
+
+#define RECORD_MAGIC "SHLRCRD"
+#define RECORD_VERSION 1
+#define RECORD_CHUNK 65536	   // bytes of events per chunk
+#define RECORD_FLUSH_SECONDS 1 // events wait at most this long before their chunk is written
+#define RECORD_EVENT_HEADER 13 // int64_t time in microseconds, uint32_t length, char type
+
+struct record_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pad;
+	int64_t started; // seconds since the epoch
+};
+// followed by chunks, each a header and then packed_len bytes of LZ4 block, or raw bytes when packed_len == raw_len
+struct record_chunk
+{
+	char magic[4];
+	uint32_t raw_len;
+	uint32_t packed_len;
+	uint32_t crc; // history_crc32() of the raw events
+	int64_t first_us, last_us;
+};
+
+struct recorder
+{
+	char *path;
+	pid_t owner; // forked children share the pty but not the threads
+	int file_fd, master_fd, slave_fd;
+	int tty_fd[2]; // the shell's own stdout and stderr
+	int wake[2];   // tells the pump to drain and stop
+	struct timespec start;
+	pthread_t pump, writer;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct byte_buf pending; // events not written yet
+	int64_t first_us, last_us;
+	bool stopping;
+};
+
+struct recorder *recorder = NULL;
+
+/// LZ4 block format: a token with the literal and match lengths, the literals, a 16 bit offset
+/// back into the output and the match length beyond 4; the last 5 bytes are always literals.
+
+#define LZ4_HASH_BITS 12
+
+int lz4_bound(int len)
+{
+	return len + len / 255 + 16;
+}
+
+// a length of 15 and more spills into bytes of 255 and a remainder
+uint8_t *lz4_put_length(uint8_t *op, int len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/**
+ * Compress a block
+ * @return bytes written to dst, which has room for lz4_bound(len)
+ */
+int lz4_compress(const uint8_t *src, int len, uint8_t *dst)
+{
+	uint32_t table[1 << LZ4_HASH_BITS] = {0}; // position + 1 of the last 4 bytes that hashed here
+	uint8_t *op = dst;
+	int ip = 0, anchor = 0;
+	while (ip < len - 12) // a match may not start in the last 12 bytes
+	{
+		uint32_t seq;
+		memcpy(&seq, src + ip, 4);
+		uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+		int ref = (int)table[h] - 1;
+		table[h] = ip + 1;
+		uint32_t seen;
+		if (ref < 0 || ip - ref > 65535 || (memcpy(&seen, src + ref, 4), seen != seq))
+		{
+			ip++;
+			continue;
+		}
+		int match = 4;
+		while (ip + match < len - 5 && src[ref + match] == src[ip + match])
+			match++;
+		int literals = ip - anchor;
+		uint8_t *token = op++;
+		*token = (literals < 15 ? literals : 15) << 4 | (match - 4 < 15 ? match - 4 : 15);
+		if (literals >= 15)
+			op = lz4_put_length(op, literals);
+		memcpy(op, src + anchor, literals);
+		op += literals;
+		*op++ = (ip - ref) & 0xFF;
+		*op++ = (ip - ref) >> 8;
+		if (match - 4 >= 15)
+			op = lz4_put_length(op, match - 4);
+		ip += match;
+		anchor = ip;
+	}
+	int literals = len - anchor;
+	*op++ = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15)
+		op = lz4_put_length(op, literals);
+	memcpy(op, src + anchor, literals);
+	return op + literals - dst;
+}
+
+/**
+ * Decompress a block, checking every length against both buffers
+ * @return bytes written to dst, or -1 if the block is damaged
+ */
+int lz4_decompress(const uint8_t *src, int len, uint8_t *dst, int size)
+{
+	int ip = 0, op = 0;
+	while (ip < len)
+	{
+		int token = src[ip++];
+		int literals = token >> 4;
+		if (literals == 15)
+			for (int b = 255; b == 255 && literals < len;)
 			{
-				if (i == 0)
+				if (ip >= len)
+					return -1;
+				b = src[ip++];
+				literals += b;
+			}
+		if (literals > len - ip || literals > size - op)
+			return -1;
+		memcpy(dst + op, src + ip, literals);
+		ip += literals;
+		op += literals;
+		if (ip == len) // the last sequence has no match
+			break;
+		if (len - ip < 2)
+			return -1;
+		int offset = src[ip] | src[ip + 1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return -1;
+		int match = token & 15;
+		if (match == 15)
+			for (int b = 255; b == 255 && match < size;)
+			{
+				if (ip >= len)
+					return -1;
+				b = src[ip++];
+				match += b;
+			}
+		match += 4;
+		if (match > size - op)
+			return -1;
+		for (int i = 0; i < match; i++) // the match may overlap what it copies
+			dst[op + i] = dst[op - offset + i];
+		op += match;
+	}
+	return op;
+}
+
+void record_event(char type, const char *data, uint32_t len)
+{
+	struct recorder *r = recorder;
+	if (r == NULL || r->owner != getpid() || len == 0)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t t = (now.tv_sec - r->start.tv_sec) * 1000000LL + (now.tv_nsec - r->start.tv_nsec) / 1000;
+	char header[RECORD_EVENT_HEADER];
+	memcpy(header, &t, 8);
+	memcpy(header + 8, &len, 4);
+	header[12] = type;
+
+	pthread_mutex_lock(&r->lock);
+	bool was_empty = r->pending.len == 0;
+	if (was_empty)
+		r->first_us = t;
+	r->last_us = t;
+	buf_append(&r->pending, header, sizeof(header));
+	buf_append(&r->pending, data, len);
+	if (was_empty || r->pending.len >= RECORD_CHUNK)
+		pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+}
+
+void record_input(const char *data, int len)
+{
+	record_event('i', data, len);
+}
+
+// the pty takes the terminal's size, checked before each prompt
+void record_track_size()
+{
+	struct winsize size;
+	if (recorder != NULL && recorder->owner == getpid() && ioctl(recorder->tty_fd[0], TIOCGWINSZ, &size) == 0)
+		ioctl(recorder->slave_fd, TIOCSWINSZ, &size);
+}
+
+bool write_all(int fd, const void *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, data, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data = (const char *)data + n;
+		len -= n;
+	}
+	return true;
+}
+
+void *record_pump(void *arg)
+{
+	struct recorder *r = arg;
+	char buf[16384];
+	struct pollfd fds[2] = {{r->master_fd, POLLIN, 0}, {r->wake[0], POLLIN, 0}};
+	int timeout = -1;
+	while (1)
+	{
+		int ready = poll(fds, 2, timeout);
+		if (ready == -1 && errno == EINTR)
+			continue;
+		if (ready <= 0) // drained after being told to stop
+			break;
+		if (fds[0].revents & POLLIN)
+		{
+			ssize_t n = read(r->master_fd, buf, sizeof(buf));
+			if (n <= 0)
+				break;
+			write_all(r->tty_fd[0], buf, n);
+			record_event('o', buf, n);
+		}
+		else if (fds[0].revents & (POLLHUP | POLLERR))
+			break;
+		if (fds[1].revents & POLLIN)
+		{
+			// whatever the shell wrote before it stopped may still be on its way through the pty
+			fds[1].fd = -1;
+			timeout = 20;
+		}
+	}
+	return NULL;
+}
+
+void *record_writer(void *arg)
+{
+	struct recorder *r = arg;
+	pthread_mutex_lock(&r->lock);
+	while (1)
+	{
+		if (r->pending.len == 0 && r->stopping)
+			break;
+		if (r->pending.len == 0)
+		{
+			pthread_cond_wait(&r->ready, &r->lock);
+			continue;
+		}
+		if (r->pending.len < RECORD_CHUNK && !r->stopping)
+		{
+			// let a burst of output fill the chunk before it is packed
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += RECORD_FLUSH_SECONDS;
+			if (pthread_cond_timedwait(&r->ready, &r->lock, &until) != ETIMEDOUT)
+				continue;
+		}
+		struct byte_buf raw = r->pending;
+		struct record_chunk chunk = {{'C', 'H', 'N', 'K'}, raw.len, 0, 0, r->first_us, r->last_us};
+		r->pending = (struct byte_buf){0};
+		pthread_mutex_unlock(&r->lock);
+
+		uint8_t *packed = malloc(lz4_bound(raw.len));
+		chunk.packed_len = lz4_compress((uint8_t *)raw.data, raw.len, packed);
+		chunk.crc = history_crc32(raw.data, raw.len);
+		bool stored = chunk.packed_len >= chunk.raw_len;
+		if (stored)
+			chunk.packed_len = chunk.raw_len;
+		write_all(r->file_fd, &chunk, sizeof(chunk));
+		write_all(r->file_fd, stored ? (uint8_t *)raw.data : packed, chunk.packed_len);
+		free(packed);
+		free(raw.data);
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+/**
+ * Put the output back on the terminal and write out everything still queued
+ */
+void record_stop()
+{
+	struct recorder *r = recorder;
+	if (r == NULL || r->owner != getpid())
+		return;
+	fflush(stdout);
+	fflush(stderr);
+	dup2(r->tty_fd[0], STDOUT_FILENO);
+	dup2(r->tty_fd[1], STDERR_FILENO);
+	write_all(r->wake[1], "", 1);
+	pthread_join(r->pump, NULL);
+
+	pthread_mutex_lock(&r->lock);
+	r->stopping = true;
+	pthread_cond_signal(&r->ready);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->writer, NULL);
+	recorder = NULL;
+
+	int fds[] = {r->file_fd, r->master_fd, r->slave_fd, r->tty_fd[0], r->tty_fd[1], r->wake[0], r->wake[1]};
+	for (int i = 0; i < 7; i++)
+		close(fds[i]);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->ready);
+	free(r->pending.data);
+	free(r->path);
+	free(r);
+}
+
+/**
+ * Start recording into a new file
+ * @return false with errno set if the file or the pty could not be made
+ */
+bool record_start(const char *path)
+{
+	struct recorder *r = calloc(1, sizeof(struct recorder));
+	r->file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	r->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	r->slave_fd = -1;
+	if (r->file_fd == -1 || r->master_fd == -1 || grantpt(r->master_fd) == -1 || unlockpt(r->master_fd) == -1 ||
+		(r->slave_fd = open(ptsname(r->master_fd), O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1 || pipe2(r->wake, O_CLOEXEC) == -1)
+	{
+		int error = errno;
+		close(r->file_fd);
+		close(r->master_fd);
+		close(r->slave_fd);
+		free(r);
+		errno = error;
+		return false;
+	}
+	// bytes go through untouched, the terminal behind the pump does the line discipline
+	struct termios raw;
+	tcgetattr(r->slave_fd, &raw);
+	cfmakeraw(&raw);
+	tcsetattr(r->slave_fd, TCSANOW, &raw);
+
+	struct record_file_header header = {RECORD_MAGIC, RECORD_VERSION, 0, time(NULL)};
+	write_all(r->file_fd, &header, sizeof(header));
+
+	r->path = strdup(path);
+	r->owner = getpid();
+	clock_gettime(CLOCK_MONOTONIC, &r->start);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->ready, NULL);
+	fflush(stdout);
+	fflush(stderr);
+	r->tty_fd[0] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	r->tty_fd[1] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+	recorder = r;
+	record_track_size();
+	dup2(r->slave_fd, STDOUT_FILENO);
+	dup2(r->slave_fd, STDERR_FILENO);
+	pthread_create(&r->pump, NULL, record_pump, r);
+	pthread_create(&r->writer, NULL, record_writer, r);
+
+	static bool registered = false;
+	if (!registered)
+		atexit(record_stop); // exit and the end of input still write the last chunk
+	registered = true;
+	return true;
+}
+
+int record_builtin(struct command_t *command)
+{
+	last_status = 0;
+	if (command->arg_count == 2 && strcmp(command->args[0], "start") == 0)
+	{
+		if (recorder != NULL)
+		{
+			printf("-%s: record: already recording to %s\n", sysname, recorder->path);
+			last_status = 1;
+		}
+		else if (!record_start(command->args[1]))
+		{
+			printf("-%s: record: %s: %s\n", sysname, command->args[1], strerror(errno));
+			last_status = 1;
+		}
+	}
+	else if (command->arg_count == 1 && strcmp(command->args[0], "stop") == 0)
+	{
+		last_status = recorder == NULL;
+		record_stop();
+	}
+	else if (command->arg_count == 0)
+	{
+		if (recorder != NULL)
+			printf("recording to %s\n", recorder->path);
+		else
+			printf("not recording\n");
+		last_status = recorder == NULL;
+	}
+	else
+	{
+		printf("Usage: record start $(file) | record stop | record\n");
+		last_status = 2;
+	}
+	return SUCCESS;
+}
+
+// keys of a line, control characters shown as ^X
+void replay_show_keys(double seconds, struct byte_buf *keys)
+{
+	printf("[%10.3f] ", seconds);
+	for (uint32_t i = 0; i < keys->len; i++)
+	{
+		unsigned char c = keys->data[i];
+		if (c < 32 || c == 127)
+			printf("^%c", c ^ 64);
+		else
+			putchar(c);
+	}
+	putchar('\n');
+	keys->len = 0;
+}
+
+int replay_builtin(struct command_t *command)
+{
+	double start = 0, speed = 1;
+	bool list = false, keys_only = false;
+	const char *path = NULL;
+	for (int i = 0; i < command->arg_count; i++)
+	{
+		if (strcmp(command->args[i], "-s") == 0 && i + 1 < command->arg_count)
+			start = strtod(command->args[++i], NULL);
+		else if (strcmp(command->args[i], "-x") == 0 && i + 1 < command->arg_count)
+			speed = strtod(command->args[++i], NULL);
+		else if (strcmp(command->args[i], "-l") == 0)
+			list = true;
+		else if (strcmp(command->args[i], "-k") == 0)
+			keys_only = true;
+		else if (path == NULL)
+			path = command->args[i];
+		else
+			path = "";
+	}
+	if (path == NULL || path[0] == 0)
+	{
+		printf("Usage: replay [-s $(seconds)] [-x $(speed)] [-k | -l] $(file)\n");
+		last_status = 2;
+		return SUCCESS;
+	}
+
+	struct record_file_header header;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic)) != 0 || header.version != RECORD_VERSION)
+	{
+		printf("-%s: replay: %s: %s\n", sysname, path, fd == -1 ? strerror(errno) : "not a recording");
+		if (fd != -1)
+			close(fd);
+		last_status = 1;
+		return SUCCESS;
+	}
+
+	int64_t start_us = start * 1e6, base_us = -1;
+	struct timespec base;
+	struct byte_buf keys = {0};
+	double keys_at = 0;
+	off_t offset = sizeof(header);
+	struct record_chunk chunk;
+	last_status = 0;
+	while (pread(fd, &chunk, sizeof(chunk), offset) == sizeof(chunk))
+	{
+		if (memcmp(chunk.magic, "CHNK", 4) != 0 || chunk.packed_len > chunk.raw_len)
+		{
+			printf("-%s: replay: %s: damaged chunk at byte %lld\n", sysname, path, (long long)offset);
+			last_status = 1;
+			break;
+		}
+		off_t data_at = offset + sizeof(chunk);
+		offset = data_at + chunk.packed_len;
+		if (list)
+		{
+			printf("%10lld  %10.3f - %10.3f  %u -> %u bytes\n", (long long)data_at - (long long)sizeof(chunk), chunk.first_us / 1e6, chunk.last_us / 1e6, chunk.raw_len, chunk.packed_len);
+			continue;
+		}
+		if (chunk.last_us < start_us) // seeking only reads the headers
+			continue;
+
+		char *packed = malloc(chunk.packed_len + 1), *raw = malloc(chunk.raw_len + 1);
+		bool ok = pread(fd, packed, chunk.packed_len, data_at) == chunk.packed_len;
+		if (ok && chunk.packed_len == chunk.raw_len)
+			memcpy(raw, packed, chunk.raw_len);
+		else if (ok)
+			ok = lz4_decompress((uint8_t *)packed, chunk.packed_len, (uint8_t *)raw, chunk.raw_len) == (int)chunk.raw_len;
+		if (!ok || history_crc32(raw, chunk.raw_len) != chunk.crc)
+		{
+			printf("-%s: replay: %s: damaged chunk at byte %lld\n", sysname, path, (long long)data_at - (long long)sizeof(chunk));
+			free(packed);
+			free(raw);
+			last_status = 1;
+			break;
+		}
+		for (uint32_t at = 0; at + RECORD_EVENT_HEADER <= chunk.raw_len;)
+		{
+			int64_t t;
+			uint32_t len;
+			memcpy(&t, raw + at, 8);
+			memcpy(&len, raw + at + 8, 4);
+			char type = raw[at + 12];
+			char *data = raw + at + RECORD_EVENT_HEADER;
+			if (len > chunk.raw_len - at - RECORD_EVENT_HEADER)
+				break;
+			at += RECORD_EVENT_HEADER + len;
+			if (t < start_us)
+				continue;
+			if (keys_only)
+			{
+				if (type != 'i')
+					continue;
+				if (keys.len == 0)
+					keys_at = t / 1e6;
+				buf_append(&keys, data, len);
+				if (data[len - 1] == '\n' || data[len - 1] == '\r')
 				{
-					strcat(bookmark_comm_set, "\"");
+					keys.len--;
+					replay_show_keys(keys_at, &keys);
 				}
-
-				strcat(bookmark_comm_set, command->args[i]);
-				if (i != command->arg_count - 1)
+				continue;
+			}
+			if (type != 'o')
+				continue;
+			if (base_us == -1)
+			{
+				base_us = t;
+				clock_gettime(CLOCK_MONOTONIC, &base);
+			}
+			if (speed > 0)
+			{
+				// sleep until the event is as far from the first one as it was when recorded
+				int64_t due = (t - base_us) / speed;
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				int64_t wait = due - ((now.tv_sec - base.tv_sec) * 1000000LL + (now.tv_nsec - base.tv_nsec) / 1000);
+				if (wait > 0)
 				{
-					strcat(bookmark_comm_set, " ");
+					fflush(stdout);
+					struct timespec pause = {wait / 1000000, wait % 1000000 * 1000};
+					nanosleep(&pause, NULL);
 				}
 			}
-			strcat(bookmark_comm_set, "\"");
+			fwrite(data, 1, len, stdout);
+		}
+		free(packed);
+		free(raw);
+	}
+	if (keys.len > 0)
+		replay_show_keys(keys_at, &keys);
+	free(keys.data);
+	fflush(stdout);
+	close(fd);
+	return SUCCESS;
+}
+
+/// on-change: runs a command line every time files under the given paths change. inotify
+/// watches every directory below them, a burst of events starts one run once it has been quiet
+/// for a moment, and a run that is still going is killed first. Nothing runs while idle.
+
+#define ON_CHANGE_DEBOUNCE_MS 100 // quiet time after the last event before the command runs
+#define ON_CHANGE_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+
+// a path or glob from the command line
+struct watch_spec
+{
+	char *root;	   // directory that is watched, "" for the working directory
+	char *pattern; // NULL for anything below root; matched against the base name when it has no slash
+	bool recursive;
+};
+
+struct watch_dir
+{
+	char *path;
+	bool recursive;
+};
+
+struct on_change
+{
+	int inotify_fd;
+	struct watch_dir *dirs; // by watch descriptor
+	int dir_count;
+	struct watch_spec *specs;
+	int spec_count;
+	bool warned; // about running out of watches
+};
+
+// drop ./ in front and / at the end, so the same directory is always spelled the same way
+char *watch_normalize(const char *path)
+{
+	while (path[0] == '.' && path[1] == '/')
+		path += 2;
+	if (strcmp(path, ".") == 0)
+		path = "";
+	char *copy = strdup(path);
+	int len = strlen(copy);
+	while (len > 1 && copy[len - 1] == '/')
+		copy[--len] = 0;
+	return copy;
+}
+
+void watch_join(char *out, size_t size, const char *dir, const char *name)
+{
+	if (dir[0] == 0)
+		snprintf(out, size, "%s", name);
+	else if (name[0] == 0)
+		snprintf(out, size, "%s", dir);
+	else
+		snprintf(out, size, "%s/%s", dir, name);
+}
+
+void watch_tree(struct on_change *w, const char *dir, bool recursive)
+{
+	int wd = inotify_add_watch(w->inotify_fd, dir[0] ? dir : ".", ON_CHANGE_EVENTS | IN_ONLYDIR);
+	if (wd == -1)
+	{
+		if (errno == ENOSPC && !w->warned)
+			printf("-%s: on-change: out of inotify watches, see /proc/sys/fs/inotify/max_user_watches\n", sysname);
+		w->warned |= errno == ENOSPC;
+		return;
+	}
+	if (wd >= w->dir_count)
+	{
+		w->dirs = realloc(w->dirs, sizeof(struct watch_dir) * (wd + 1));
+		memset(w->dirs + w->dir_count, 0, sizeof(struct watch_dir) * (wd + 1 - w->dir_count));
+		w->dir_count = wd + 1;
+	}
+	else if (w->dirs[wd].path != NULL)
+	{
+		// watched already, by another spec or before a rename
+		w->dirs[wd].recursive |= recursive;
+		if (!recursive)
+			return;
+		free(w->dirs[wd].path);
+	}
+	w->dirs[wd].path = strdup(dir);
+	w->dirs[wd].recursive |= recursive;
+	if (!recursive)
+		return;
+
+	DIR *d = opendir(dir[0] ? dir : ".");
+	struct dirent *entry;
+	char path[4096];
+	while (d != NULL && (entry = readdir(d)) != NULL)
+	{
+		if (entry->d_name[0] == '.') // also skips .git and the like
+			continue;
+		watch_join(path, sizeof(path), dir, entry->d_name);
+		struct stat st;
+		if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && lstat(path, &st) == 0 && S_ISDIR(st.st_mode)))
+			watch_tree(w, path, true);
+	}
+	if (d != NULL)
+		closedir(d);
+}
+
+bool watch_matches(struct on_change *w, const char *path)
+{
+	for (int i = 0; i < w->spec_count; i++)
+	{
+		struct watch_spec *spec = &w->specs[i];
+		int root_len = strlen(spec->root);
+		if (root_len > 0 && (strncmp(path, spec->root, root_len) != 0 || (path[root_len] != '/' && path[root_len] != 0)))
+			continue;
+		if (spec->pattern == NULL)
+			return true;
+		const char *base = strrchr(path, '/');
+		if (fnmatch(spec->pattern, strchr(spec->pattern, '/') ? path : base ? base + 1 : path, 0) == 0)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Turn a path or glob into what is watched and what is matched
+ */
+struct watch_spec watch_parse(const char *arg)
+{
+	struct watch_spec spec = {0};
+	char *path = watch_normalize(arg);
+	struct stat st;
+	if (strpbrk(path, "*?[") == NULL && stat(path[0] ? path : ".", &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		spec.root = path;
+		spec.recursive = true;
+		return spec;
+	}
+	spec.pattern = path;
+	// the directories in front of the first wildcard are watched, everything below them when there is one
+	const char *wild = strpbrk(path, "*?[");
+	spec.recursive = wild != NULL;
+	const char *end = wild != NULL ? wild : path + strlen(path);
+	while (end > path && *end != '/')
+		end--;
+	spec.root = strndup(path, end - path);
+	return spec;
+}
 
-			free(command->args[0]);
-			command->args[0] = bookmark_comm_set;
-		}
-		if (fork() == 0)
-		{
-			bookmark(command);
-			exit(0);
-		}
-		else
-		{
-			if (!command->background)
-				wait(0); // wait for child process to finish
-			return SUCCESS;
-		}
-		return SUCCESS;
+// the command runs in a forked shell of its own process group, so it can be killed with whatever it started
+pid_t on_change_start(struct command_t *job, sigset_t *old_mask, int fds[2])
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		setpgid(0, 0);
+		close(fds[0]);
+		close(fds[1]);
+		sigprocmask(SIG_SETMASK, old_mask, NULL);
+		int null = open("/dev/null", O_RDONLY);
+		dup2(null, STDIN_FILENO); // the terminal is not theirs to read
+		close(null);
+		no_fork = true; // a program replaces this child
+		process_command(job);
+		fflush(stdout);
+		exit(last_status);
 	}
+	if (pid > 0)
+		setpgid(pid, pid);
+	return pid;
+}
 
-	if (strcmp(command->name, "remindme") == 0)
+/**
+ * Stop a run: SIGTERM for its whole group, SIGKILL when it is still there a second later
+ * @return its wait status
+ */
+int on_change_cancel(pid_t pid)
+{
+	int status = 0;
+	kill(-pid, SIGTERM);
+	sigset_t child;
+	sigemptyset(&child);
+	sigaddset(&child, SIGCHLD);
+	struct timespec deadline, now;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec++;
+	while (waitpid(pid, &status, WNOHANG) == 0)
 	{
-		if (fork() == 0)
-		{
-			remindme(command);
-			exit(0);
-		}
-		else
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t left = (deadline.tv_sec - now.tv_sec) * 1000000000LL + deadline.tv_nsec - now.tv_nsec;
+		struct timespec wait = {left / 1000000000, left % 1000000000};
+		if (left <= 0 || sigtimedwait(&child, NULL, &wait) == -1)
 		{
-			if (!command->background)
-				wait(0); // wait for child process to finish
-			return SUCCESS;
+			if (errno != EAGAIN && errno != EINTR && left > 0)
+				continue;
+			kill(-pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			break;
 		}
-		return SUCCESS;
 	}
+	return status;
+}
 
-	if (strcmp(command->name, "pingsweep") == 0)
+int on_change_builtin(struct command_t *command)
+{
+	int debounce = ON_CHANGE_DEBOUNCE_MS, first = 0, split = -1;
+	if (command->arg_count > 1 && strcmp(command->args[0], "-d") == 0)
 	{
-		builtinComm = true;
+		debounce = atoi(command->args[1]);
+		first = 2;
+	}
+	for (int i = first; i < command->arg_count && split == -1; i++)
+		if (strcmp(command->args[i], "--") == 0)
+			split = i;
+	if (split <= first || split + 1 >= command->arg_count || debounce < 0)
+	{
+		printf("Usage: on-change [-d $(milliseconds)] $(path or glob)... -- $(command)\n");
+		last_status = 2;
+		return SUCCESS;
+	}
 
-		if (command->arg_count != 3)
-		{
-			printf("Usage: pingsweep $subnet $start $end\nIn range (0,254)\n");
-			return SUCCESS;
-		}
+	// the words after -- are already expanded, they run as they are and are not parsed again
+	struct command_t words = {0};
+	words.name = command->args[split + 1];
+	words.args = command->args + split + 2;
+	words.arg_count = command->arg_count - split - 2;
+	struct command_t *job = clone_command(&words);
 
-		const char *subnet_command = command->args[0];
-		const char *start_command = command->args[1];
-		const char *end_command = command->args[2];
+	struct on_change w = {0};
+	w.inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (w.inotify_fd == -1)
+	{
+		printf("-%s: on-change: %s\n", sysname, strerror(errno));
+		free_command(job);
+		last_status = 1;
+		return SUCCESS;
+	}
+	w.spec_count = split - first;
+	w.specs = malloc(sizeof(struct watch_spec) * w.spec_count);
+	for (int i = 0; i < w.spec_count; i++)
+	{
+		w.specs[i] = watch_parse(command->args[first + i]);
+		watch_tree(&w, w.specs[i].root, w.specs[i].recursive);
+	}
 
-		if (fork() == 0)
+	// Ctrl-C ends the watch and the end of a run is noticed, both read from a signalfd
+	sigset_t mask, old_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	int fds[2] = {w.inotify_fd, signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)};
+
+	pid_t running = 0;
+	bool pending = false;
+	struct timespec due = {0}, now;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	last_status = 0;
+	while (1)
+	{
+		int timeout = -1;
+		if (pending)
 		{
-			ping_sweep(subnet_command, start_command, end_command);
-			exit(0);
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			int64_t left = (due.tv_sec - now.tv_sec) * 1000 + (due.tv_nsec - now.tv_nsec) / 1000000;
+			timeout = left < 0 ? 0 : left;
 		}
-		else
+		struct pollfd pfds[2] = {{fds[0], POLLIN, 0}, {fds[1], POLLIN, 0}};
+		int ready = poll(pfds, 2, timeout);
+		if (ready == -1 && errno == EINTR)
+			continue;
+		if (ready == 0 && pending)
 		{
-			if (!command->background)
-				wait(0); // wait for child process to finish
-			return SUCCESS;
+			pending = false;
+			if (running > 0)
+				on_change_cancel(running);
+			running = on_change_start(job, &old_mask, fds);
+			continue;
 		}
-	}
 
-	if (strcmp(command->name, "exit") == 0)
-		return EXIT;
+		bool interrupted = false;
+		struct signalfd_siginfo info;
+		while (read(fds[1], &info, sizeof(info)) == sizeof(info))
+			interrupted |= info.ssi_signo == SIGINT;
+		int status;
+		if (running > 0 && waitpid(running, &status, WNOHANG) == running)
+		{
+			running = 0;
+			last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		}
+		if (interrupted)
+			break;
 
-	if (strcmp(command->name, "cd") == 0)
-	{
-		if (command->arg_count > 0)
+		ssize_t n;
+		bool changed = false;
+		while ((n = read(fds[0], events, sizeof(events))) > 0)
+			for (char *p = events; p < events + n;)
+			{
+				struct inotify_event *event = (struct inotify_event *)p;
+				p += sizeof(struct inotify_event) + event->len;
+				if (event->mask & IN_Q_OVERFLOW)
+					changed = true;
+				if (event->wd < 0 || event->wd >= w.dir_count || w.dirs[event->wd].path == NULL)
+					continue;
+				struct watch_dir *dir = &w.dirs[event->wd];
+				if (event->mask & IN_IGNORED) // the directory is gone
+				{
+					free(dir->path);
+					dir->path = NULL;
+					continue;
+				}
+				char path[4096];
+				watch_join(path, sizeof(path), dir->path, event->len ? event->name : "");
+				if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && dir->recursive && event->name[0] != '.')
+					watch_tree(&w, path, true);
+				changed |= watch_matches(&w, path);
+			}
+		if (changed)
 		{
-			r = chdir(command->args[0]);
-			if (r == -1)
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			return SUCCESS;
+			// every event pushes the run back, so a burst of them ends in one run
+			pending = true;
+			clock_gettime(CLOCK_MONOTONIC, &due);
+			due.tv_nsec += (debounce % 1000) * 1000000L;
+			due.tv_sec += debounce / 1000 + due.tv_nsec / 1000000000;
+			due.tv_nsec %= 1000000000;
 		}
 	}
 
-	pid_t pid = fork();
-	if (pid == 0) // child
+	if (running > 0)
+		on_change_cancel(running);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	close(fds[0]);
+	close(fds[1]);
+	for (int i = 0; i < w.dir_count; i++)
+		free(w.dirs[i].path);
+	for (int i = 0; i < w.spec_count; i++)
 	{
-		/// This shows how to do exec with environ (but is not available on MacOs)
-		// extern char** environ; // environment variables
-		// execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-		/// This shows how to do exec with auto-path resolve
-		// add a NULL argument to the end of args, and the name to the beginning
-		// as required by exec
-
-		// increase args size by 2
-		command->args = (char **)realloc(
-			command->args, sizeof(char *) * (command->arg_count += 2));
+		free(w.specs[i].root);
+		free(w.specs[i].pattern);
+	}
+	free(w.dirs);
+	free(w.specs);
+	free_command(job);
+	last_status = 130;
+	return SUCCESS;
+}
 
-		// shift everything forward by 1
-		for (int i = command->arg_count - 2; i > 0; --i)
-			command->args[i] = command->args[i - 1];
+/// limit: runs a command with its resources capped. A monitor process makes a cgroup v2 for the
+/// job under the shell's own cgroup, or under $SHELLINGTON_CGROUP when that names a delegated
+/// one, and writes cpu.max, memory.max and pids.max there. A limit the cgroup cannot take falls
+/// back to rlimits and CPU affinity set in the child before it execs; -v reports the usage after.
+/// The shell's own cgroup holds the shell, so turning controllers on for its children fails with
+/// EBUSY (no internal processes); without $SHELLINGTON_CGROUP the job cgroup usually only accounts.
 
-		// set args[0] as a copy of name
-		command->args[0] = strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count - 1] = NULL;
+struct job_limits
+{
+	double cpus;		   // CPUs worth of time per period
+	long long memory;	   // bytes
+	long long procs;	   // processes and threads
+	long long cpu_seconds; // total CPU time
+	long long files;	   // open files
+	bool verbose;
+};
 
-		/*
-		execvp(command->name, command->args); // exec+args+path
-		exit(0);
-		No Need for these lines after path resolving implementation
-		*/
-		/// TODO: do your own exec with path resolving using execv()
+// 512K, 1G... in bytes, -1 if it is not a size
+long long parse_size(const char *text)
+{
+	char *end;
+	double value = strtod(text, &end);
+	const char *units = "KMGT";
+	const char *unit = *end ? strchr(units, *end & ~32) : NULL;
+	if (end == text || value < 0 || (*end && (unit == NULL || end[1] != 0)))
+		return -1;
+	for (int i = unit ? unit - units + 1 : 0; i > 0; i--)
+		value *= 1024;
+	return value;
+}
 
-		/// response to TODO: finds the absolute path of the file for the first input then gets the args for execv().
-		char *file_path = search_path(command->args[0]);
-		if (file_path == NULL && !builtinComm)
-		{
-			printf("-%s: %s: command not found\n", sysname, command->name);
-		}
-		execv(file_path, command->args);
-		exit(0);
-	}
+/**
+ * Find the cgroup v2 that job cgroups are made under
+ * @return false if there is none, the job then only gets rlimits
+ */
+bool limit_cgroup_base(char *out, size_t size)
+{
+	const char *base = get_variable("SHELLINGTON_CGROUP");
+	if (base != NULL)
+		snprintf(out, size, "%s", base); // empty turns cgroups off
 	else
 	{
-		if (!command->background)
-			wait(0); // wait for child process to finish
-		return SUCCESS;
+		// the line of the unified hierarchy is 0::/path
+		out[0] = 0;
+		char line[4096];
+		FILE *fp = fopen("/proc/self/cgroup", "r");
+		while (fp != NULL && fgets(line, sizeof(line), fp) != NULL)
+			if (strncmp(line, "0::/", 4) == 0)
+			{
+				line[strcspn(line, "\n")] = 0;
+				snprintf(out, size, "/sys/fs/cgroup%s", strcmp(line + 3, "/") == 0 ? "" : line + 3);
+			}
+		if (fp != NULL)
+			fclose(fp);
 	}
+	char controllers[4096 + 32];
+	snprintf(controllers, sizeof(controllers), "%s/cgroup.controllers", out);
+	return out[0] != 0 && access(controllers, R_OK) == 0;
+}
 
-	// TODO: your implementation here
+bool cgroup_write(const char *dir, const char *file, const char *value)
+{
+	char path[4096 + 64];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	bool ok = fd != -1 && write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+	if (fd != -1)
+		close(fd);
+	return ok;
+}
 
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
+/**
+ * Read a number from a cgroup file, the value after key for files of key value lines
+ * @return -1 if it is not there
+ */
+long long cgroup_read(const char *dir, const char *file, const char *key)
+{
+	char path[4096 + 64], line[256];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	FILE *fp = fopen(path, "r");
+	long long value = -1;
+	int key_len = key ? strlen(key) : 0;
+	while (fp != NULL && value == -1 && fgets(line, sizeof(line), fp) != NULL)
+		if (key == NULL)
+			value = atoll(line);
+		else if (strncmp(line, key, key_len) == 0 && line[key_len] == ' ')
+			value = atoll(line + key_len + 1);
+	if (fp != NULL)
+		fclose(fp);
+	return value;
 }
 
-// Added code for using execv
-int file_exists(const char *path_name)
+// set a limit file of the job, turning its controller on in the parent first if need be; that is
+// refused with EBUSY when the parent has processes of its own, like the cgroup the shell runs in
+bool cgroup_limit(const char *base, const char *job, const char *controller, const char *file, const char *value)
 {
-	// opens the path directory to read file path which if exists:
-	// 1. the pointer will not be null
-	// 2. under the condition of one will return true since path to file exists and is valid
-	FILE *fp;
+	if (cgroup_write(job, file, value))
+		return true;
+	char enable[32];
+	snprintf(enable, sizeof(enable), "+%s", controller);
+	return cgroup_write(base, "cgroup.subtree_control", enable) && cgroup_write(job, file, value);
+}
 
-	if ((fp = fopen(path_name, "r")))
+// what the child does before it runs the command, for the limits the cgroup did not take
+void limit_apply_rlimits(struct job_limits *limits, bool cpu_set, bool memory_set)
+{
+	struct rlimit limit;
+	if (limits->cpu_seconds > 0)
 	{
-		fclose(fp);
-		return 1;
+		limit.rlim_cur = limits->cpu_seconds;
+		limit.rlim_max = limits->cpu_seconds + 1; // SIGXCPU first, SIGKILL a second later
+		setrlimit(RLIMIT_CPU, &limit);
+	}
+	if (limits->files > 0)
+	{
+		limit.rlim_cur = limit.rlim_max = limits->files;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	if (limits->memory > 0 && !memory_set)
+	{
+		limit.rlim_cur = limit.rlim_max = limits->memory;
+		setrlimit(RLIMIT_AS, &limit);
+	}
+	if (limits->cpus > 0 && !cpu_set)
+	{
+		// without a bandwidth limit the job is kept to as many CPUs as it may use
+		cpu_set_t allowed, kept;
+		CPU_ZERO(&kept);
+		int want = limits->cpus + 0.999;
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE && CPU_COUNT(&kept) < want; cpu++)
+				if (CPU_ISSET(cpu, &allowed))
+					CPU_SET(cpu, &kept);
+			sched_setaffinity(0, sizeof(kept), &kept);
+		}
 	}
-
-	return 0;
 }
-char *search_path(const char *file_name)
+
+/**
+ * The monitor: sets up the job's cgroup, runs the command in a child of its own and waits for it
+ */
+void limit_monitor(struct job_limits *limits, struct command_t *command)
 {
-	// is intended to traverse the existing shell path environment var
-	// $PATH to get the individual file path tokens to scan them all
-	char *env = getenv("PATH");
-	// for the $PATH var the outputs delimiter is ":", for unix based devices
-	const char delim[2] = ":";
-	char *paths_env = strtok(env, delim);
+	char base[4096], job[4096 + 32], value[64];
+	bool in_cgroup = false, cpu_set = false, memory_set = false, procs_set = false;
+	if (limit_cgroup_base(base, sizeof(base)))
+	{
+		snprintf(job, sizeof(job), "%s/shellington-%d", base, getpid());
+		in_cgroup = mkdir(job, 0755) == 0;
+	}
+	if (in_cgroup && limits->cpus > 0)
+	{
+		snprintf(value, sizeof(value), "%lld 100000", (long long)(limits->cpus * 100000));
+		cpu_set = cgroup_limit(base, job, "cpu", "cpu.max", value);
+	}
+	if (in_cgroup && limits->memory > 0)
+	{
+		snprintf(value, sizeof(value), "%lld", limits->memory);
+		memory_set = cgroup_limit(base, job, "memory", "memory.max", value);
+		cgroup_write(job, "memory.swap.max", "0");
+	}
+	if (in_cgroup && limits->procs > 0)
+	{
+		snprintf(value, sizeof(value), "%lld", limits->procs);
+		procs_set = cgroup_limit(base, job, "pids", "pids.max", value);
+	}
+	if (limits->procs > 0 && !procs_set)
+	{
+		// RLIMIT_NPROC counts every process of the user, a user already running n could not even start the job
+		printf("-%s: limit: --procs needs a cgroup with the pids controller, RLIMIT_NPROC would count all of the user's processes\n", sysname);
+		if (in_cgroup)
+			rmdir(job);
+		exit(1);
+	}
 
-	//initializing the path array to check if the concatenation of the desired file_name to it exists
-	const int max_len = 30;
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		if (in_cgroup)
+			cgroup_write(job, "cgroup.procs", "0");
+		limit_apply_rlimits(limits, cpu_set, memory_set);
+		no_fork = true; // a program replaces this child
+		process_command(command);
+		fflush(stdout);
+		exit(last_status);
+	}
+	signal(SIGINT, SIG_IGN); // Ctrl-C is for the job, the monitor still has to clean up after it
 
-	while (paths_env != NULL)
+	int status = 0;
+	struct rusage usage = {0};
+	while (pid > 0 && wait4(pid, &status, 0, &usage) == -1 && errno == EINTR)
+		;
+	if (limits->verbose)
 	{
-		// Intention is to search for the path in a manner where $PATH[i]/path
-		// is an existing file meaning that it's the file at question to be executed
-		char *path = malloc(sizeof(paths_env) + max_len);
-		if (path == NULL)
+		double cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+		long long peak = usage.ru_maxrss * 1024LL;
+		if (in_cgroup)
 		{
-			//in case of a failed malloc
-			return NULL;
+			long long usec = cgroup_read(job, "cpu.stat", "usage_usec"), cgroup_peak = cgroup_read(job, "memory.peak", NULL);
+			cpu = usec >= 0 ? usec / 1e6 : cpu;
+			peak = cgroup_peak >= 0 ? cgroup_peak : peak;
 		}
-		path[max_len] = NULL;
-		strcpy(path, paths_env);
-		strcat(path, "/");
-		strcat(path, file_name);
+		fprintf(stderr, "%s: limit: %s%s%s%s: cpu %.3fs, memory peak %.1fM", sysname, in_cgroup ? job : "rlimits",
+				in_cgroup ? " (" : "", in_cgroup ? (cpu_set || memory_set || procs_set ? "cgroup limits" : "cgroup for accounting, rlimits") : "", in_cgroup ? ")" : "",
+				cpu, peak / 1048576.0);
+		long long oom = in_cgroup ? cgroup_read(job, "memory.events", "oom_kill") : -1;
+		if (oom > 0)
+			fprintf(stderr, ", %lld killed for memory", oom);
+		fprintf(stderr, ", status %d\n", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+	}
+	if (in_cgroup)
+		rmdir(job);
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
 
-		if (file_exists(path))
+int limit_builtin(struct command_t *command)
+{
+	struct job_limits limits = {0};
+	int i = 0;
+	for (; i < command->arg_count && command->args[i][0] == '-'; i++)
+	{
+		const char *option = command->args[i], *arg = i + 1 < command->arg_count ? command->args[i + 1] : "";
+		bool ok = true;
+		if (strcmp(option, "-v") == 0)
 		{
-			return path;
+			limits.verbose = true;
+			continue;
 		}
-		paths_env = strtok(NULL, delim);
-		free(path);
+		if (strcmp(option, "--cpu") == 0)
+			ok = (limits.cpus = strtod(arg, NULL)) > 0;
+		else if (strcmp(option, "--mem") == 0)
+			ok = (limits.memory = parse_size(arg)) > 0;
+		else if (strcmp(option, "--procs") == 0)
+			ok = (limits.procs = atoll(arg)) > 0;
+		else if (strcmp(option, "--time") == 0)
+			ok = (limits.cpu_seconds = atoll(arg)) > 0;
+		else if (strcmp(option, "--files") == 0)
+			ok = (limits.files = atoll(arg)) > 0;
+		else
+			ok = false;
+		if (!ok)
+		{
+			i = command->arg_count;
+			break;
+		}
+		i++;
 	}
-	return NULL;
+	if (i >= command->arg_count)
+	{
+		printf("Usage: limit [--cpu $(cpus)] [--mem $(size)] [--procs $(n)] [--time $(cpu seconds)] [--files $(n)] [-v] $(command)\n");
+		last_status = 2;
+		return SUCCESS;
+	}
+
+	// the words after the options are the command
+	free(command->name);
+	command->name = command->args[i];
+	for (int j = 0; j < i; j++)
+		free(command->args[j]);
+	command->arg_count -= i + 1;
+	memmove(command->args, command->args + i + 1, sizeof(char *) * command->arg_count);
+	bool background = command->background;
+	command->background = false;
+
+	fflush(stdout);
+	pid_t monitor = fork();
+	if (monitor == 0)
+		limit_monitor(&limits, command);
+	last_status = monitor == -1 ? 1 : background ? 0 : wait_status(monitor);
+	return SUCCESS;
 }
-/// TODO: create new c files for each new custom command and in the end make a makefile to compile them together.
+
+/// TODO: create new c files for each new custom command and have the Makefile compile them together.
 
 // Added code for short function
 
 int shortcut(struct command_t *command)
 {
+	if (command->arg_count < 2)
+	{
+		printf("Usage: short set $(alias) | short jump $(alias or part of a visited directory)\n");
+		return 1;
+	}
 	const char *set_jump = command->args[0];
 	const char *alias = command->args[1];
-	const char pwd[BUF_SIZE];
+	char pwd[BUF_SIZE];
 	getcwd(pwd, sizeof(pwd));
 
 	const char *delim = ":";
+	int status = 0;
 
-	char *filedir = malloc(strlen("shorttxt") + strlen(w));
-
-	strcat(filedir, w);
+	char *filedir = malloc(strlen("/shorttxt") + strlen(w) + 1);
+	strcpy(filedir, w);
 	strcat(filedir, "/shorttxt");
 
 	FILE *fp = fopen(filedir, "a");
@@ -635,24 +6888,30 @@ int shortcut(struct command_t *command)
 				return 1;
 			}
 			/// TODO: read the file to find the desired alias token and then its corresponding value is the directory execution shell will point to
-			const char *jumpdir = search_short(fp2, alias);
+			char *jumpdir = search_short(fp2, alias);
 			fclose(fp2);
-			if (strcmp(jumpdir, "DNE") != 0)
+			// an alias set by hand wins, otherwise the best match among the visited directories
+			if (jumpdir == NULL)
+				jumpdir = frecency_best(alias);
+			if (jumpdir != NULL)
 			{
 				jump_to(jumpdir, command);
 			}
 			else
 			{
 				printf("Invalid alias\n");
+				status = 1;
 			}
+			free(jumpdir);
 		}
 		else
 		{
 			printf("Invalid Command\n");
+			status = 1;
 		}
 		free(filedir);
 		fclose(fp);
-		return 0;
+		return status;
 	}
 	else
 	{
@@ -664,9 +6923,9 @@ int shortcut(struct command_t *command)
 	return 0;
 }
 
-const char *search_short(FILE *fp, const char *alias)
+char *search_short(FILE *fp, const char *alias)
 {
-	char *line = malloc(BUF_SIZE);
+	char line[BUF_SIZE];
 
 	while (fgets(line, BUF_SIZE, fp) != NULL)
 	{
@@ -674,46 +6933,41 @@ const char *search_short(FILE *fp, const char *alias)
 		// constrained to alias:dir\n
 		const char *aliasToken = strtok(line, ":");
 		const char *dirToken = strtok(NULL, "\n");
-		if (strcmp(alias, aliasToken) == 0)
+		if (aliasToken != NULL && dirToken != NULL && strcmp(alias, aliasToken) == 0)
 		{
-			return dirToken;
+			return strdup(dirToken);
 		}
 	}
 
-	// only return this when the shortcut is not found (recommended to not set DNE as an alias)
-	return "DNE";
+	// only return this when the shortcut is not found
+	return NULL;
 }
 
 void jump_to(const char *loc, struct command_t *command)
 {
 	/// TODO: jump to loc using system call cd
 
-	char *arg_list[] = {loc, NULL};
-	struct command_t *cdcomm = malloc(sizeof(struct command_t));
-
-	cdcomm->args = malloc(sizeof(arg_list));
-	cdcomm->name = malloc(sizeof("cd"));
+	char *arg_list[] = {(char *)loc, NULL};
+	struct command_t cdcomm = {0};
 
-	strcpy(cdcomm->name, "cd");
-
-	cdcomm->args = arg_list;
-	cdcomm->arg_count = 2;
-	cdcomm->background = command->background;
-	cdcomm->next = NULL;
+	cdcomm.name = (char *)"cd";
+	cdcomm.args = arg_list;
+	cdcomm.arg_count = 1;
+	cdcomm.background = command->background;
 	// create a cd command since the jumping action is basically a cd command
-	process_command(cdcomm);
+	process_command(&cdcomm);
 }
 // Added code for bookmark func
 void bookmark(struct command_t *command)
 {
 
 	FILE *fp;
-	char single_line[BUF_SIZE];
+	char single_line[1000];
 
 	char *task = command->args[0];
 	char *target = command->args[1];
 
-	char filedir[strlen("bookmarktxt") + strlen(w)];
+	char filedir[strlen("/bookmarktxt") + strlen(w) + 1];
 	strcpy(filedir, w);
 	strcat(filedir, "/bookmarktxt");
 	if (strcmp(task, "bookmark") == 0)
@@ -774,67 +7028,21 @@ void bookmark(struct command_t *command)
 				return;
 			}
 
-			char sinle_line[1000];
+			// lines are: index "command"
+			int target_len = strlen(target);
 			while (fgets(single_line, 1000, fp) != NULL)
 			{
-
-				if (strncmp(single_line, target, 1) == 0)
+				if (strncmp(single_line, target, target_len) != 0 || single_line[target_len] != ' ')
+					continue;
+				char *start = strchr(single_line, '"'), *end = strrchr(single_line, '"');
+				if (start != NULL && end > start)
 				{
-					char *tok = strtok(single_line, " ");
-					tok = strtok(NULL, single_line);
-					tok = tok + 1;
-
-					struct command_t *comm_exec = malloc(sizeof(struct command_t));
-
-					char *tokenized_name = strtok(tok, " ");
-					comm_exec->name = malloc(sizeof(tokenized_name));
-					comm_exec->name = tokenized_name;
-
-					char *tokenized_comms[BUF_SIZE];
-
-					int i = 0;
-					tok = strtok(NULL, " ");
-					char tok_end = tok[strlen(tok) - 2];
-
-					for (i; tok_end != '\0' && tok_end != '"' && tok_end != '\n'; i++)
-					{
-
-						tokenized_comms[i] = tok;
-
-						tok_end = tok[strlen(tok) - 1];
-						if (tok_end == '"')
-						{
-							tokenized_comms[i] = strtok(tok, "\"");
-							tok_end = tok[strlen(tok) - 2];
-							break;
-						}
-						else
-						{
-							tokenized_comms[i] = strtok(tok, " ");
-						}
-					}
-					if (tok_end == '"')
-					{
-						tokenized_comms[i] = strtok(tok, "\"");
-					}
-
-					comm_exec->arg_count = i + 1;
-
-					int j;
-					comm_exec->args = malloc(sizeof(comm_exec->args) + sizeof(tokenized_comms[j]));
-
-					for (j = 0; j < comm_exec->arg_count; j++)
-					{
-						comm_exec->args = realloc(comm_exec->args, sizeof(comm_exec->args) + sizeof(tokenized_comms[j]));
-						comm_exec->args[j] = tokenized_comms[j];
-					}
-
-					comm_exec->background = command->background;
-					comm_exec->next = NULL;
-
-					process_command(comm_exec);
+					*end = 0;
+					run_command_line(start + 1);
 				}
+				break;
 			}
+			fclose(fp);
 		}
 	}
 	else
@@ -933,7 +7141,17 @@ void remindme(struct command_t *command)
 			strcat(p, " * * * XDG_RUNTIME_DIR=/run/user/$(id -u) notify-send ");
 			strcat(p, commd);
 			strcat(p, "';}| crontab - ");
-			system(p); // Executed the reminder which is saved in crontab editor
+			// Executed the reminder which is saved in crontab editor, with the shell's exported variables
+			char *sh_args[] = {"sh", "-c", p, NULL};
+			char **envp = shell_environ();
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				execve("/bin/sh", sh_args, envp);
+				exit(127);
+			}
+			wait_status(pid);
 		}
 		else
 			printf("Please schedule a time appropriately.\n");
@@ -970,6 +7188,7 @@ int ping_sweep(const char *subnet, const char *range_start, const char *range_en
 		return 0;
 	}
 
+	char **envp = shell_environ();
 	pid_t pid_main = fork();
 	if (pid_main == 0)
 	{
@@ -1004,7 +7223,7 @@ int ping_sweep(const char *subnet, const char *range_start, const char *range_en
 			pid_t pid = fork();
 			if (pid == 0)
 			{
-				execv(file_path, args);
+				execve(file_path, args, envp);
 			}
 			else
 			{
@@ -1023,24 +7242,122 @@ int ping_sweep(const char *subnet, const char *range_start, const char *range_en
 
 
 //Author: Batu ALtınok 
-void private_dir(struct command_t* command) { //Basically making a private directory 
-int i;
-char commd[BUF_SIZE*command->arg_count]; // Our input
-char make_private[BUF_SIZE*command->arg_count]; 
+/// pmkdir: private directories, mode 0700, made with mkdirat() relative to the working directory.
+/// Large batches are spread over a pool of threads that take the next directory as they finish one.
+
+#define PMKDIR_THREAD_MIN 256 // directories before the work is spread over threads
+#define PMKDIR_MAX_THREADS 16
 
-strcpy(commd,"mkdir "); 
-strcat(commd,command->args[0]); // mkdir input ready
+struct pmkdir_job
+{
+	char **dirs;
+	int count;
+	bool parents;
+	bool fix_mode; // the umask takes owner bits away, so each directory is chmod'ed after mkdir
+	int next;	   // next directory to take, shared by the threads
+	int *errors;   // errno per directory, 0 when it was made
+};
 
-strcpy(make_private,"chmod "); // making directory private ready
-strcat(make_private,command->args[0]);
-strcat(make_private,"700");
+// mkdirat() that leaves the directory at 0700 whatever the umask is
+int pmkdir_one(const char *path, bool fix_mode)
+{
+	if (mkdirat(cwd_fd, path, 0700) == -1)
+		return -1;
+	if (fix_mode)
+		fchmodat(cwd_fd, path, 0700, 0);
+	return 0;
+}
 
+/**
+ * Make a directory, and with parents also the directories on the way to it
+ * @return 0, or the errno of the failed mkdirat()
+ */
+int pmkdir_path(char *path, bool parents, bool fix_mode)
+{
+	if (pmkdir_one(path, fix_mode) == 0)
+		return 0;
+	int error = errno;
+	struct stat st;
+	if (!parents)
+		return error;
+	if (error == EEXIST)
+		return fstatat(cwd_fd, path, &st, 0) == 0 && S_ISDIR(st.st_mode) ? 0 : ENOTDIR;
+	if (error != ENOENT)
+		return error;
+	// make the missing parents from the top down, cutting the path at each slash in turn
+	for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+	{
+		if (slash[-1] == '/')
+			continue;
+		*slash = 0;
+		int made = pmkdir_one(path, fix_mode) == 0 || errno == EEXIST ? 0 : errno;
+		*slash = '/';
+		if (made != 0)
+			return made;
+	}
+	if (pmkdir_one(path, fix_mode) == 0)
+		return 0;
+	error = errno;
+	return error == EEXIST && fstatat(cwd_fd, path, &st, 0) == 0 && S_ISDIR(st.st_mode) ? 0 : error;
+}
 
+void *pmkdir_run_job(void *arg)
+{
+	struct pmkdir_job *job = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+		job->errors[i] = pmkdir_path(job->dirs[i], job->parents, job->fix_mode);
+	return NULL;
+}
 
-system(commd);
-system(make_private); // Executing the making directory and converting to private
+int private_dir(struct command_t *command)
+{
+	struct pmkdir_job job = {0};
+	int first = 0;
+	if (command->arg_count > 0 && strcmp(command->args[0], "-p") == 0)
+	{
+		job.parents = true;
+		first = 1;
+	}
+	if (first == command->arg_count)
+	{
+		printf("Usage: pmkdir [-p] directory...\n");
+		last_status = 2;
+		return SUCCESS;
+	}
+	if (cwd_fd == -1)
+		cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	mode_t mask = umask(0);
+	umask(mask);
+	job.fix_mode = (mask & 0700) != 0;
+	job.dirs = command->args + first;
+	job.count = command->arg_count - first;
+	job.errors = calloc(job.count, sizeof(int));
+
+	int threads = 1;
+	if (job.count >= PMKDIR_THREAD_MIN)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus < 1 ? 1 : cpus > PMKDIR_MAX_THREADS ? PMKDIR_MAX_THREADS : cpus;
+	}
+	pthread_t ids[PMKDIR_MAX_THREADS];
+	int started = 0;
+	for (; started < threads - 1; started++)
+		if (pthread_create(&ids[started], NULL, pmkdir_run_job, &job) != 0)
+			break;
+	pmkdir_run_job(&job); // this thread works too
+	for (int i = 0; i < started; i++)
+		pthread_join(ids[i], NULL);
 
-printf("Private directory created.\n"); // End
+	last_status = 0;
+	for (int i = 0; i < job.count; i++)
+		if (job.errors[i] != 0)
+		{
+			printf("-%s: pmkdir: %s: %s\n", sysname, job.dirs[i], strerror(job.errors[i]));
+			last_status = 1;
+		}
+	free(job.errors);
+	return SUCCESS;
 }
 
 